@@ -0,0 +1,145 @@
+/*
+ * affinity.c
+ * CPU and NUMA placement helpers
+ *
+ * NUMA topology is taken from sysfs, so no libnuma is required;
+ * memory is placed node-locally by allocating it from pinned threads.
+ */
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <dirent.h>
+#include <ifaddrs.h>
+#include <netdb.h>
+#include <sys/socket.h>
+
+#include "common.h"
+#include "affinity.h"
+
+/*
+ * Parse a CPU list like "0-3,8,10-11" into an array of CPU numbers.
+ * Returns the number of CPUs or a negative error.
+ */
+int affinity_parse_cpus(const char *list, int **cpus)
+{
+	int *out = NULL, nr = 0, first, last, cpu, len;
+	const char *p = list;
+
+	while (*p) {
+		if (sscanf(p, "%d%n", &first, &len) != 1 || first < 0)
+			goto out_inval;
+		p += len;
+		last = first;
+		if (*p == '-') {
+			p++;
+			if (sscanf(p, "%d%n", &last, &len) != 1 ||
+			    last < first)
+				goto out_inval;
+			p += len;
+		}
+		if (*p == ',')
+			p++;
+		else if (*p)
+			goto out_inval;
+		for (cpu = first; cpu <= last; cpu++) {
+			int *tmp = realloc(out, (nr + 1) * sizeof(int));
+
+			if (!tmp) {
+				free(out);
+				return -ENOMEM;
+			}
+			out = tmp;
+			out[nr++] = cpu;
+		}
+	}
+	if (!nr)
+		goto out_inval;
+	*cpus = out;
+	return nr;
+
+out_inval:
+	fprintf(stderr, "invalid cpu list '%s'\n", list);
+	free(out);
+	return -EINVAL;
+}
+
+/*
+ * Returns the NUMA node of @cpu, or -1 if unknown.
+ */
+int affinity_cpu_node(int cpu)
+{
+	char path[64];
+	struct dirent *d;
+	DIR *dir;
+	int node = -1;
+
+	sprintf(path, "/sys/devices/system/cpu/cpu%d", cpu);
+	dir = opendir(path);
+	if (!dir)
+		return -1;
+	while ((d = readdir(dir))) {
+		if (sscanf(d->d_name, "node%d", &node) == 1)
+			break;
+		node = -1;
+	}
+	closedir(dir);
+	return node;
+}
+
+/*
+ * Returns the NUMA node of the network device owning @traddr, or -1
+ * if unknown (e.g. for virtual devices or wildcard addresses).
+ */
+int affinity_addr_node(const char *traddr, sa_family_t adrfam)
+{
+	struct ifaddrs *ifaddr, *ifa;
+	char host[NI_MAXHOST], path[PATH_MAX];
+	int node = -1;
+	FILE *f;
+
+	if (getifaddrs(&ifaddr) < 0)
+		return -1;
+	for (ifa = ifaddr; ifa; ifa = ifa->ifa_next) {
+		if (!ifa->ifa_addr || ifa->ifa_addr->sa_family != adrfam)
+			continue;
+		if (getnameinfo(ifa->ifa_addr, adrfam == AF_INET6 ?
+				sizeof(struct sockaddr_in6) :
+				sizeof(struct sockaddr_in),
+				host, sizeof(host), NULL, 0,
+				NI_NUMERICHOST))
+			continue;
+		if (strcmp(host, traddr))
+			continue;
+		snprintf(path, sizeof(path),
+			 "/sys/class/net/%s/device/numa_node", ifa->ifa_name);
+		f = fopen(path, "r");
+		if (f) {
+			if (fscanf(f, "%d", &node) != 1)
+				node = -1;
+			fclose(f);
+		}
+		break;
+	}
+	freeifaddrs(ifaddr);
+	return node;
+}
+
+int affinity_pin(pthread_t thread, int *cpus, int nr_cpus)
+{
+	cpu_set_t set;
+	int i, ret;
+
+	if (!nr_cpus)
+		return 0;
+	CPU_ZERO(&set);
+	for (i = 0; i < nr_cpus; i++)
+		CPU_SET(cpus[i], &set);
+	ret = pthread_setaffinity_np(thread, sizeof(set), &set);
+	if (ret)
+		fprintf(stderr, "failed to set thread affinity, error %d\n",
+			ret);
+	return -ret;
+}
@@ -0,0 +1,9 @@
+#ifndef _NVMET_AFFINITY_H
+#define _NVMET_AFFINITY_H
+
+int affinity_parse_cpus(const char *list, int **cpus);
+int affinity_cpu_node(int cpu);
+int affinity_addr_node(const char *traddr, sa_family_t adrfam);
+int affinity_pin(pthread_t thread, int *cpus, int nr_cpus);
+
+#endif /* _NVMET_AFFINITY_H */
@@ -0,0 +1,561 @@
+/*
+ * bench.c
+ * Microbenchmarks for the hot paths of the discovery controller
+ *
+ * Runs the daemon's own code outside of the daemon; each benchmark
+ * compares it with the implementation it replaced where that is
+ * useful.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <getopt.h>
+#include <sys/socket.h>
+#include <netinet/tcp.h>
+
+#include "common.h"
+#include "crc32c.h"
+#include "tcp.h"
+
+#define ARRAY_SIZE(a)	(int)(sizeof(a) / sizeof((a)[0]))
+
+#define BENCH_LOG_LEN	4096
+
+/* Defined in daemon.c for the daemon itself */
+int stopped;
+int tcp_debug;
+int cmd_debug;
+
+static u64 bench_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (u64)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * The linear scan tcp_acquire_tag() used before free tags were kept
+ * in a bitmap, minus the payload allocation which is not measured.
+ */
+static struct ep_qe *scan_acquire_tag(struct endpoint *ep,
+				      union nvme_tcp_pdu *pdu, u16 ccid)
+{
+	int i;
+
+	for (i = 0; i < ep->qsize; i++) {
+		struct ep_qe *qe = &ep->qes[i];
+
+		if (!qe->busy) {
+			qe->busy = true;
+			qe->ccid = ccid;
+			memcpy(&qe->pdu, pdu, pdu->common.hlen);
+			memset(&qe->resp, 0, sizeof(qe->resp));
+			qe->resp.command_id = 0xffff;
+			return qe;
+		}
+	}
+	return NULL;
+}
+
+static void scan_release_tag(struct endpoint *ep, struct ep_qe *qe)
+{
+	qe->busy = false;
+}
+
+/*
+ * Keep @depth commands outstanding and complete them in order, like
+ * a host pipelining commands on one queue. Returns nsecs per
+ * acquire/release pair, or 0 if a tag could not be acquired.
+ */
+static double bench_tags_run(int qsize, int depth, long iters, bool scan)
+{
+	union nvme_tcp_pdu pdu;
+	struct endpoint ep;
+	struct ep_qe **ring, *qe;
+	long i;
+	u64 start;
+	double ns = 0;
+
+	memset(&ep, 0, sizeof(ep));
+	memset(&pdu, 0, sizeof(pdu));
+	pdu.common.hlen = sizeof(struct nvme_tcp_cmd_pdu);
+	ring = calloc(depth, sizeof(*ring));
+	if (!ring || tcp_alloc_tags(&ep, qsize) < 0) {
+		fprintf(stderr, "tags: out of memory\n");
+		free(ring);
+		return 0;
+	}
+	for (i = 0; i < depth; i++) {
+		ring[i] = scan ? scan_acquire_tag(&ep, &pdu, i) :
+			tcp_acquire_tag(&ep, &pdu, i, 0, 0);
+		if (!ring[i])
+			goto out;
+	}
+	start = bench_now_ns();
+	for (i = 0; i < iters; i++) {
+		qe = ring[i % depth];
+		if (scan) {
+			scan_release_tag(&ep, qe);
+			qe = scan_acquire_tag(&ep, &pdu, i);
+		} else {
+			tcp_release_tag(&ep, qe);
+			qe = tcp_acquire_tag(&ep, &pdu, i, 0, 0);
+		}
+		if (!qe)
+			goto out;
+		ring[i % depth] = qe;
+	}
+	ns = (double)(bench_now_ns() - start) / iters;
+out:
+	free(ring);
+	free(ep.qes);
+	free(ep.tag_map);
+	return ns;
+}
+
+static int bench_tags(int argc, char **argv)
+{
+	static const int qsizes[] = { 32, 128, 1024 };
+	long iters = 10000000;
+	int c, i, j, depths[2];
+
+	while ((c = getopt(argc, argv, "n:")) != -1) {
+		switch (c) {
+		case 'n':
+			iters = strtol(optarg, NULL, 10);
+			break;
+		default:
+			return 1;
+		}
+	}
+	if (iters <= 0)
+		return 1;
+
+	printf("%-6s %-6s %12s %12s\n", "qsize", "depth", "scan ns",
+	       "bitmap ns");
+	for (i = 0; i < ARRAY_SIZE(qsizes); i++) {
+		/* An idle queue, and one kept full by a pipelining host */
+		depths[0] = 1;
+		depths[1] = qsizes[i] - 1;
+		for (j = 0; j < 2; j++)
+			printf("%-6d %-6d %12.1f %12.1f\n", qsizes[i], depths[j],
+			       bench_tags_run(qsizes[i], depths[j], iters, true),
+			       bench_tags_run(qsizes[i], depths[j], iters,
+					      false));
+	}
+	return 0;
+}
+
+/*
+ * Check @name against the table-driven implementation for all
+ * alignments and lengths around the lane boundaries.
+ */
+static int bench_crc_check(const char *name, const u8 *buf)
+{
+	static const size_t lens[] = {
+		0, 1, 7, 8, 9, 767, 768, 769, 4096, 6143, 6144, 6145,
+		12288 + 775, 65536,
+	};
+	u32 ref, crc;
+	int i, off;
+
+	for (i = 0; i < ARRAY_SIZE(lens); i++) {
+		for (off = 0; off < 8; off++) {
+			crc32c_select("table-driven");
+			ref = crc32c(0, buf + off, lens[i]);
+			crc32c_select(name);
+			crc = crc32c(0, buf + off, lens[i]);
+			if (crc != ref) {
+				fprintf(stderr, "crc: %s mismatch len %zu "
+					"offset %d: %08x, expected %08x\n",
+					name, lens[i], off, crc, ref);
+				return -EINVAL;
+			}
+		}
+	}
+	/* Chained over a split buffer */
+	crc = crc32c(crc32c(0, buf, 1000), buf + 1000, 20000);
+	crc32c_select("table-driven");
+	if (crc != crc32c(0, buf, 21000)) {
+		fprintf(stderr, "crc: %s chaining mismatch\n", name);
+		return -EINVAL;
+	}
+	return 0;
+}
+
+static int bench_crc(int argc, char **argv)
+{
+	static const char *names[] = { "table-driven", "sse4.2", "pclmul" };
+	static const size_t sizes[] = { 72, 1024, 4096, 65536, 1048576 };
+	size_t bytes = 1UL << 30, total;
+	int c, i, j;
+	u8 *buf;
+	u64 start, ns;
+	u32 crc = 0;
+
+	while ((c = getopt(argc, argv, "b:")) != -1) {
+		switch (c) {
+		case 'b':
+			bytes = strtoul(optarg, NULL, 10) << 20;
+			break;
+		default:
+			return 1;
+		}
+	}
+	if (!bytes)
+		return 1;
+
+	crc32c_init();
+	buf = malloc(sizes[ARRAY_SIZE(sizes) - 1] + 8);
+	if (!buf) {
+		fprintf(stderr, "crc: out of memory\n");
+		return 1;
+	}
+	for (i = 0; i < sizes[ARRAY_SIZE(sizes) - 1] + 8; i++)
+		buf[i] = rand();
+
+	printf("%-14s", "bytes");
+	for (j = 0; j < ARRAY_SIZE(sizes); j++)
+		printf(" %9zu", sizes[j]);
+	printf("  (GB/s)\n");
+	for (i = 0; i < ARRAY_SIZE(names); i++) {
+		if (crc32c_select(names[i]) < 0) {
+			printf("%-14s not supported\n", names[i]);
+			continue;
+		}
+		if (bench_crc_check(names[i], buf) < 0) {
+			free(buf);
+			return 1;
+		}
+		crc32c_select(names[i]);
+		printf("%-14s", names[i]);
+		for (j = 0; j < ARRAY_SIZE(sizes); j++) {
+			start = bench_now_ns();
+			for (total = 0; total < bytes; total += sizes[j])
+				crc = crc32c(crc, buf, sizes[j]);
+			ns = bench_now_ns() - start;
+			printf(" %9.2f", (double)total / ns);
+		}
+		printf("\n");
+	}
+	/* Keep the loops from being optimized away */
+	if (!crc)
+		printf("crc %08x\n", crc);
+	free(buf);
+	return 0;
+}
+
+static int bench_write(int fd, const void *buf, size_t len)
+{
+	const u8 *p = buf;
+	ssize_t n;
+
+	while (len) {
+		n = write(fd, p, len);
+		if (n < 0)
+			return -errno;
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+static int bench_read(int fd, void *buf, size_t len)
+{
+	u8 *p = buf;
+	ssize_t n;
+
+	while (len) {
+		n = read(fd, p, len);
+		if (n < 0)
+			return -errno;
+		if (!n)
+			return -ECONNRESET;
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/*
+ * Wait for the completion of the command in flight, discarding any
+ * C2H data. Returns the NVMe status or a negative errno.
+ */
+static int bench_wait(int fd)
+{
+	static u8 data[BENCH_LOG_LEN];
+	union nvme_tcp_pdu pdu;
+	u32 plen;
+	int ret;
+
+	for (;;) {
+		ret = bench_read(fd, &pdu, sizeof(pdu.common));
+		if (ret < 0)
+			return ret;
+		plen = le32toh(pdu.common.plen);
+		if (plen < pdu.common.hlen || pdu.common.hlen > sizeof(pdu) ||
+		    plen - pdu.common.hlen > sizeof(data))
+			return -EPROTO;
+		ret = bench_read(fd, (u8 *)&pdu + sizeof(pdu.common),
+				 pdu.common.hlen - sizeof(pdu.common));
+		if (!ret)
+			ret = bench_read(fd, data, plen - pdu.common.hlen);
+		if (ret < 0)
+			return ret;
+		if (pdu.common.type == nvme_tcp_rsp)
+			return le16toh(pdu.rsp.cqe.status) >> 1;
+		if (pdu.common.type != nvme_tcp_c2h_data)
+			return -EPROTO;
+		if (pdu.common.flags & NVME_TCP_F_DATA_SUCCESS)
+			return 0;
+	}
+}
+
+static int bench_get_log_page(int fd, u16 cid)
+{
+	struct nvme_tcp_cmd_pdu pdu;
+	struct nvme_get_log_page_command *cmd =
+		(struct nvme_get_log_page_command *)&pdu.cmd;
+	u32 numd = BENCH_LOG_LEN / 4 - 1;
+	int ret;
+
+	memset(&pdu, 0, sizeof(pdu));
+	pdu.hdr.type = nvme_tcp_cmd;
+	pdu.hdr.hlen = sizeof(pdu);
+	pdu.hdr.plen = htole32(sizeof(pdu));
+	cmd->opcode = nvme_admin_get_log_page;
+	cmd->flags = NVME_CMD_SGL_METABUF;
+	cmd->command_id = cid;
+	cmd->dptr.sgl.length = htole32(BENCH_LOG_LEN);
+	cmd->dptr.sgl.type = NVME_TRANSPORT_SGL_DATA_DESC << 4 |
+		NVME_SGL_FMT_TRANSPORT_A;
+	cmd->lid = NVME_LOG_DISC;
+	cmd->numdl = htole16(numd & 0xffff);
+	cmd->numdu = htole16(numd >> 16);
+	ret = bench_write(fd, &pdu, sizeof(pdu));
+	return ret < 0 ? ret : bench_wait(fd);
+}
+
+/*
+ * Connect to the discovery controller at @sa as a host would: ICReq,
+ * Connect and a first Get Log Page. With @tfo the ICReq is sent with
+ * the SYN. Returns the connected socket or a negative errno.
+ */
+static int bench_connect_host(struct sockaddr_in *sa, const char *hostnqn,
+			      bool tfo)
+{
+	struct {
+		struct nvme_tcp_cmd_pdu pdu;
+		struct nvmf_connect_data data;
+	} capsule;
+	struct nvmf_connect_command *cmd =
+		(struct nvmf_connect_command *)&capsule.pdu.cmd;
+	struct nvme_tcp_icreq_pdu icreq;
+	struct nvme_tcp_icresp_pdu icresp;
+	int fd, one = 1, ret;
+
+	fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (fd < 0)
+		return -errno;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+	memset(&icreq, 0, sizeof(icreq));
+	icreq.hdr.type = nvme_tcp_icreq;
+	icreq.hdr.hlen = sizeof(icreq);
+	icreq.hdr.plen = htole32(sizeof(icreq));
+	icreq.pfv = htole16(NVME_TCP_PFV_1_0);
+	if (tfo) {
+		if (sendto(fd, &icreq, sizeof(icreq), MSG_FASTOPEN,
+			   (struct sockaddr *)sa, sizeof(*sa)) < 0)
+			ret = -errno;
+		else
+			ret = 0;
+	} else {
+		if (connect(fd, (struct sockaddr *)sa, sizeof(*sa)) < 0)
+			ret = -errno;
+		else
+			ret = bench_write(fd, &icreq, sizeof(icreq));
+	}
+	if (!ret)
+		ret = bench_read(fd, &icresp, sizeof(icresp));
+	if (ret < 0)
+		goto out_close;
+	if (icresp.hdr.type != nvme_tcp_icresp) {
+		ret = -EPROTO;
+		goto out_close;
+	}
+
+	memset(&capsule, 0, sizeof(capsule));
+	capsule.pdu.hdr.type = nvme_tcp_cmd;
+	capsule.pdu.hdr.hlen = sizeof(capsule.pdu);
+	capsule.pdu.hdr.pdo = sizeof(capsule.pdu);
+	capsule.pdu.hdr.plen = htole32(sizeof(capsule));
+	cmd->opcode = nvme_fabrics_command;
+	cmd->fctype = nvme_fabrics_type_connect;
+	cmd->dptr.sgl.length = htole32(sizeof(capsule.data));
+	cmd->dptr.sgl.type = NVME_SGL_FMT_DATA_DESC << 4 |
+		NVME_SGL_FMT_OFFSET;
+	cmd->sqsize = htole16(31);
+	cmd->kato = htole32(30000);
+	capsule.data.cntlid = htole16(0xffff);
+	strcpy(capsule.data.subsysnqn, NVME_DISC_SUBSYS_NAME);
+	strncpy(capsule.data.hostnqn, hostnqn, NVMF_NQN_FIELD_LEN - 1);
+	ret = bench_write(fd, &capsule, sizeof(capsule));
+	if (!ret)
+		ret = bench_wait(fd);
+	if (!ret)
+		ret = bench_get_log_page(fd, 1);
+	if (ret) {
+		if (ret > 0)
+			fprintf(stderr, "connect: status %#x\n", ret);
+		ret = ret < 0 ? ret : -EIO;
+		goto out_close;
+	}
+	return fd;
+
+out_close:
+	close(fd);
+	return ret;
+}
+
+static int bench_cmp_u64(const void *a, const void *b)
+{
+	u64 x = *(const u64 *)a, y = *(const u64 *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void bench_print_lat(const char *name, u64 *lat, long n)
+{
+	qsort(lat, n, sizeof(*lat), bench_cmp_u64);
+	printf("%-22s p50 %8.1f us  p99 %8.1f us  max %8.1f us\n", name,
+	       lat[n / 2] / 1000.0, lat[n * 99 / 100] / 1000.0,
+	       lat[n - 1] / 1000.0);
+}
+
+/*
+ * Latency against a running daemon: connect-to-first-log-page for
+ * @iters fresh connections, then @iters log page round trips on a
+ * connection kept open.
+ */
+static int bench_connect(int argc, char **argv)
+{
+	struct sockaddr_in sa;
+	const char *addr = "127.0.0.1", *hostnqn = "nqn.bench";
+	int port = NVME_TCP_DISC_PORT, c, fd = -1, ret = 1;
+	long iters = 1000, i;
+	bool tfo = false;
+	u64 start, *lat;
+
+	while ((c = getopt(argc, argv, "a:fn:p:q:")) != -1) {
+		switch (c) {
+		case 'a':
+			addr = optarg;
+			break;
+		case 'f':
+			tfo = true;
+			break;
+		case 'n':
+			iters = strtol(optarg, NULL, 10);
+			break;
+		case 'p':
+			port = atoi(optarg);
+			break;
+		case 'q':
+			hostnqn = optarg;
+			break;
+		default:
+			return 1;
+		}
+	}
+	memset(&sa, 0, sizeof(sa));
+	sa.sin_family = AF_INET;
+	sa.sin_port = htons(port);
+	if (iters <= 0 || inet_pton(AF_INET, addr, &sa.sin_addr) != 1)
+		return 1;
+	lat = calloc(iters, sizeof(*lat));
+	if (!lat) {
+		fprintf(stderr, "connect: out of memory\n");
+		return 1;
+	}
+
+	for (i = 0; i < iters; i++) {
+		start = bench_now_ns();
+		fd = bench_connect_host(&sa, hostnqn, tfo);
+		if (fd < 0) {
+			fprintf(stderr, "connect: %s:%d failed, error %d\n",
+				addr, port, -fd);
+			goto out_free;
+		}
+		lat[i] = bench_now_ns() - start;
+		if (i < iters - 1)
+			close(fd);
+	}
+	bench_print_lat(tfo ? "connect + log (TFO)" : "connect + log", lat,
+			iters);
+
+	for (i = 0; i < iters; i++) {
+		start = bench_now_ns();
+		c = bench_get_log_page(fd, i + 2);
+		if (c) {
+			fprintf(stderr, "connect: get log page failed, %d\n",
+				c);
+			goto out_close;
+		}
+		lat[i] = bench_now_ns() - start;
+	}
+	bench_print_lat("log page round trip", lat, iters);
+	ret = 0;
+out_close:
+	close(fd);
+out_free:
+	free(lat);
+	return ret;
+}
+
+static const struct {
+	const char *name;
+	int (*run)(int argc, char **argv);
+	const char *usage;
+} benches[] = {
+	{ "tags", bench_tags,
+	  "[-n iterations]\n\ttag allocator against the linear scan" },
+	{ "crc", bench_crc,
+	  "[-b MiB per size]\n\tCRC32C kernel throughput" },
+	{ "connect", bench_connect,
+	  "[-a addr] [-p port] [-q hostnqn] [-n iterations] [-f]\n"
+	  "\tconnect-to-log-page and log page latency against a daemon,\n"
+	  "\twith -f using TCP Fast Open" },
+};
+
+static void usage(const char *prg)
+{
+	int i;
+
+	fprintf(stderr, "Usage: %s <benchmark> [options]\n", prg);
+	for (i = 0; i < ARRAY_SIZE(benches); i++)
+		fprintf(stderr, "  %s %s\n", benches[i].name, benches[i].usage);
+}
+
+int main(int argc, char **argv)
+{
+	int i;
+
+	if (argc < 2) {
+		usage(argv[0]);
+		return 1;
+	}
+	for (i = 0; i < ARRAY_SIZE(benches); i++) {
+		if (strcmp(argv[1], benches[i].name))
+			continue;
+		if (benches[i].run(argc - 1, argv + 1)) {
+			usage(argv[0]);
+			return 1;
+		}
+		return 0;
+	}
+	usage(argv[0]);
+	return 1;
+}
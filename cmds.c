@@ -6,8 +6,10 @@
 #include <arpa/inet.h>
 
 #include "common.h"
-#include "discdb.h"
+#include "reactor.h"
 #include "tcp.h"
+#include "topology.h"
+#include "worker.h"
 
 #define ctrl_info(e, f, x...)					\
 	if (cmd_debug) {					\
@@ -38,20 +40,23 @@
 
 #define NVME_VER ((1 << 16) | (4 << 8)) /* NVMe 1.4 */
 
+/* Handler status flag to clear DNR, the host should retry the command */
+#define NVME_SC_RETRY	0x10000
+
+/* Retain Asynchronous Event, bit 15 of Get Log Page cdw10 */
+#define NVME_LOG_RAE	0x80
+
 LIST_HEAD(ctrl_list);
 pthread_mutex_t ctrl_mutex = PTHREAD_MUTEX_INITIALIZER;
 
 static int nvmf_ctrl_id = 1;
 
 static int send_response(struct endpoint *ep, struct ep_qe *qe,
-			 u16 status)
+			 int status)
 {
-	int ret;
-
-	set_response(&qe->resp, qe->ccid, status, true);
-	ret = tcp_send_rsp(ep, &qe->resp);
-	tcp_release_tag(ep, qe);
-	return ret;
+	set_response(&qe->resp, qe->ccid, status & 0xffff,
+		     !(status & NVME_SC_RETRY));
+	return tcp_send_rsp(ep, &qe->resp, qe);
 }
 
 static int handle_property_set(struct endpoint *ep, struct ep_qe *qe,
@@ -129,7 +134,10 @@ static int handle_set_features(struct endpoint *ep, struct ep_qe *qe,
 					      ep->ctrl->max_endpoints);
 		break;
 	case NVME_FEAT_ASYNC_EVENT:
+		/* Read by the notifier under ctrl_mutex */
+		pthread_mutex_lock(&ctrl_mutex);
 		ep->ctrl->aen_mask = cdw11;
+		pthread_mutex_unlock(&ctrl_mutex);
 		break;
 	case NVME_FEAT_KATO:
 		/* cdw11 / kato is in msecs */
@@ -141,15 +149,22 @@ static int handle_set_features(struct endpoint *ep, struct ep_qe *qe,
 	return ret;
 }
 
-static int handle_connect(struct endpoint *ep, struct ep_qe *qe,
+/*
+ * Connecting an I/O queue resizes it, which moves the command to a
+ * new queue entry; @qep is updated accordingly.
+ */
+static int handle_connect(struct endpoint *ep, struct ep_qe **qep,
 			  struct nvme_command *cmd)
 {
+	struct ep_qe *qe = *qep;
 	struct ctrl_conn *ctrl;
 	struct nvmf_connect_data *connect = qe->data;
+	int max_ctrls = ep->iface->ctx->max_host_ctrls;
+	int nr_ctrls = 0;
 	u16 sqsize;
 	u16 cntlid, qid;
 	u32 kato;
-	int ret;
+	int ret = 0;
 
 	qid = le16toh(cmd->connect.qid);
 	sqsize = le16toh(cmd->connect.sqsize);
@@ -158,11 +173,9 @@ static int handle_connect(struct endpoint *ep, struct ep_qe *qe,
 	ctrl_info(ep, "nvme_fabrics_connect qid %u sqsize %u kato %u",
 		  qid, sqsize, kato);
 
-	ret = tcp_recv_data(ep, connect, qe->data_len);
-	if (ret) {
-		ctrl_err(ep, "tcp_recv_data failed with error %d",
-			 errno);
-		return ret;
+	if (qe->recv_len < sizeof(*connect)) {
+		ctrl_err(ep, "short connect data, %llu bytes", qe->recv_len);
+		return NVME_SC_CONNECT_INVALID_PARAM;
 	}
 
 	cntlid = le16toh(connect->cntlid);
@@ -183,11 +196,13 @@ static int handle_connect(struct endpoint *ep, struct ep_qe *qe,
 	}
 	if (qid == 0) {
 		ep->qsize = NVMF_SQ_DEPTH;
-	} else if (endpoint_update_qdepth(ep, sqsize) < 0) {
+	} else if (endpoint_update_qdepth(ep, qep, sqsize) < 0) {
 		ctrl_err(ep, "qid %d failed to increase sqsize %d",
 		       qid, sqsize);
 		return NVME_SC_INTERNAL;
 	}
+	/* Moved by the resize, and so has cmd */
+	qe = *qep;
 
 	ep->qid = qid;
 
@@ -201,6 +216,7 @@ static int handle_connect(struct endpoint *ep, struct ep_qe *qe,
 	pthread_mutex_lock(&ctrl_mutex);
 	list_for_each_entry(ctrl, &ctrl_list, node) {
 		if (!strncmp(connect->hostnqn, ctrl->nqn, MAX_NQN_SIZE)) {
+			nr_ctrls++;
 			if (qid == 0 || ctrl->cntlid != cntlid)
 				continue;
 			ep->ctrl = ctrl;
@@ -208,6 +224,14 @@ static int handle_connect(struct endpoint *ep, struct ep_qe *qe,
 			break;
 		}
 	}
+	if (!ep->ctrl && qid == 0 && max_ctrls && nr_ctrls >= max_ctrls) {
+		pthread_mutex_unlock(&ctrl_mutex);
+		ctrl_err(ep, "host '%s' has %d controllers, rejecting",
+			 connect->hostnqn, nr_ctrls);
+		__atomic_add_fetch(&admission_stats.host_rejected, 1,
+				   __ATOMIC_RELAXED);
+		return NVME_SC_CONNECT_CTRL_BUSY | NVME_SC_RETRY;
+	}
 	if (!ep->ctrl) {
 		ctrl_info(ep, "Allocating new controller '%s'",
 			  connect->hostnqn);
@@ -222,6 +246,7 @@ static int handle_connect(struct endpoint *ep, struct ep_qe *qe,
 			ep->ctrl = ctrl;
 			ctrl->num_endpoints = 1;
 			ctrl->cntlid = nvmf_ctrl_id++;
+			INIT_LIST_HEAD(&ctrl->aer_list);
 			list_add(&ctrl->node, &ctrl_list);
 		}
 	}
@@ -233,6 +258,7 @@ static int handle_connect(struct endpoint *ep, struct ep_qe *qe,
 	}
 	if (!ret) {
 		ctrl_info(ep, "connected");
+		interface_handshake_done(ep);
 		qe->resp.result.u16 = htole16(ep->ctrl->cntlid);
 	}
 	return ret;
@@ -267,13 +293,17 @@ static int handle_identify_ctrl(struct endpoint *ep, u8 *id_buf, u64 len)
 	memset(id.fr, ' ', sizeof(id.fr));
 	strncpy((char *) id.fr, " ", sizeof(id.fr));
 
-	id.mdts = 0;
+	/* MDTS is a power of two in units of the minimum page size */
+	if (ep->mdts)
+		id.mdts = __builtin_ctz(ep->mdts / 4096);
 	id.cmic = 3;
 	id.cntlid = htole16(ep->ctrl->cntlid);
 	id.ver = htole32(NVME_VER);
 	id.lpa = (1 << 2);
 	id.sgls = htole32(1 << 0) | htole32(1 << 2) | htole32(1 << 20);
 	id.kas = ep->kato_interval / 100; /* KAS is in units of 100 msecs */
+	id.aerl = NVMF_NR_AER - 1; /* 0's based */
+	id.oaes = htole32(NVME_AEN_CFG_DISC_CHANGE);
 
 	id.cntrltype = ep->ctrl->ctrl_type;
 	strcpy(id.subnqn, ep->iface->ctx->subsys.subsysnqn);
@@ -316,75 +346,258 @@ static int handle_identify(struct endpoint *ep, struct ep_qe *qe,
 	return ret;
 }
 
-static int format_disc_log(void *data, u64 data_offset,
-			   u64 data_len, struct endpoint *ep)
+/*
+ * Take the oldest outstanding AER of @ctrl if a discovery log change
+ * is to be reported; the caller completes it. Must be called with
+ * ctrl_mutex held.
+ */
+static struct ep_qe *ctrl_aer_event(struct ctrl_conn *ctrl)
+{
+	struct ep_qe *qe;
+
+	if (!ctrl->aen_pending || ctrl->aen_masked ||
+	    !(ctrl->aen_mask & NVME_AEN_CFG_DISC_CHANGE) ||
+	    list_empty(&ctrl->aer_list))
+		return NULL;
+	qe = list_first_entry(&ctrl->aer_list, struct ep_qe, work_node);
+	list_del_init(&qe->work_node);
+	ctrl->nr_aer--;
+	ctrl->aen_pending = false;
+	ctrl->aen_masked = true;
+	qe->resp.result.u32 = htole32(NVME_LOG_DISC << 16 |
+				      NVME_AER_NOTICE_DISC_CHANGED << 8 |
+				      NVME_AER_NOTICE);
+	return qe;
+}
+
+/*
+ * AERs are parked on the controller and completed through the
+ * reactor done list like commands executed on a worker thread.
+ */
+static int handle_async_event(struct endpoint *ep, struct ep_qe *qe)
+{
+	struct ctrl_conn *ctrl = ep->ctrl;
+	struct ep_qe *event;
+	int nr_aer;
+
+	if (!ctrl) {
+		ctrl_err(ep, "ccid %#x nvme_async_event before connect",
+			 qe->ccid);
+		return NVME_SC_CMD_SEQ_ERROR;
+	}
+	pthread_mutex_lock(&ctrl_mutex);
+	if (ctrl->nr_aer >= NVMF_NR_AER) {
+		pthread_mutex_unlock(&ctrl_mutex);
+		ctrl_err(ep, "ccid %#x AER limit exceeded", qe->ccid);
+		return NVME_SC_ASYNC_LIMIT;
+	}
+	qe->work_status = 0;
+	ep->nr_work++;
+	list_add_tail(&qe->work_node, &ctrl->aer_list);
+	nr_aer = ++ctrl->nr_aer;
+	event = ctrl_aer_event(ctrl);
+	pthread_mutex_unlock(&ctrl_mutex);
+
+	ctrl_info(ep, "ccid %#x nvme_async_event, %d outstanding",
+		  qe->ccid, nr_aer);
+	if (event)
+		reactor_complete_work(event);
+	return 0;
+}
+
+/*
+ * Drop the AERs of an endpoint which is being closed; the reactor
+ * releases their tags when picking them up from the done list.
+ */
+void handle_aer_abort(struct endpoint *ep)
 {
-	int len, log_len, genctr, num_recs = 0;
-	u8 *log_buf;
-	struct nvmf_disc_rsp_page_hdr *log_hdr;
-	struct nvmf_disc_rsp_page_entry *log_ptr;
-
-	len = discdb_host_disc_entries(ep->ctrl->nqn, NULL, 0);
-	if (len < 0) {
-		ctrl_err(ep, "error formatting discovery log page");
-		return -1;
-	}
-	num_recs = len / sizeof(struct nvmf_disc_rsp_page_entry);
-	log_len = len + sizeof(struct nvmf_disc_rsp_page_hdr);
-	log_buf = malloc(log_len);
-	if (!log_buf) {
+	struct ctrl_conn *ctrl = ep->ctrl;
+	struct ep_qe *qe, *_qe;
+	LIST_HEAD(aborted);
+
+	if (!ctrl || ep->qid)
+		return;
+	pthread_mutex_lock(&ctrl_mutex);
+	list_for_each_entry_safe(qe, _qe, &ctrl->aer_list, work_node) {
+		if (qe->ep != ep)
+			continue;
+		list_move_tail(&qe->work_node, &aborted);
+		ctrl->nr_aer--;
+	}
+	pthread_mutex_unlock(&ctrl_mutex);
+	reactor_complete_list(&aborted);
+}
+
+static struct topo_host *disc_log_host(struct topo_snapshot *snap,
+					const char *nqn)
+{
+	struct topo_host *host = topology_find_host(snap, nqn);
+
+	return host ? host : &snap->unknown;
+}
+
+/*
+ * Compare the log page of a host entry by entry rather than by the
+ * generation counter, which is bumped by changes that do not alter
+ * the log page and not by all that do. Hosts not in the database see
+ * the log page for unknown hosts.
+ */
+static bool disc_log_changed(struct topo_snapshot *old,
+			     struct topo_snapshot *snap, const char *nqn)
+{
+	struct topo_host *a, *b;
+	int i;
+
+	if (!old)
+		return true;
+	a = disc_log_host(old, nqn);
+	b = disc_log_host(snap, nqn);
+	if (a->nr_entries != b->nr_entries)
+		return true;
+	for (i = 0; i < a->nr_entries; i++) {
+		if (memcmp(a->entries[i], b->entries[i],
+			   sizeof(*a->entries[i])))
+			return true;
+	}
+	return false;
+}
+
+/*
+ * Raise a discovery log change event on every controller whose log
+ * page differs between @old and the just published @snap. Called
+ * once per published snapshot, ie once per batch of configfs
+ * changes; the resulting AER completions are handed to the reactors
+ * in a single batch.
+ */
+void handle_disc_change(struct topo_snapshot *old,
+			struct topo_snapshot *snap)
+{
+	struct ctrl_conn *ctrl;
+	struct ep_qe *qe;
+	LIST_HEAD(events);
+	int nr_changed = 0, nr_events = 0;
+
+	pthread_mutex_lock(&ctrl_mutex);
+	list_for_each_entry(ctrl, &ctrl_list, node) {
+		if (!disc_log_changed(old, snap, ctrl->nqn))
+			continue;
+		nr_changed++;
+		ctrl->aen_pending = true;
+		qe = ctrl_aer_event(ctrl);
+		if (!qe)
+			continue;
+		list_add_tail(&qe->work_node, &events);
+		nr_events++;
+	}
+	pthread_mutex_unlock(&ctrl_mutex);
+
+	if (cmd_debug && nr_changed)
+		printf("discovery log changed for %d controllers, "
+		       "%d events sent\n", nr_changed, nr_events);
+	reactor_complete_list(&events);
+}
+
+static void disc_log_put(void *ref)
+{
+	topology_put(ref);
+}
+
+/*
+ * The discovery log page is not copied into the command buffer; the
+ * header and entries are sent as a gather list straight from the
+ * current topology snapshot, which is referenced until the tag is
+ * released.
+ * Hosts read large log pages in chunks, so the gather list only
+ * covers the entries overlapping the requested window; the header
+ * and all entries have the same size, so these are found by index.
+ * Returns the number of bytes to transfer.
+ */
+static int format_disc_log(struct endpoint *ep, struct ep_qe *qe)
+{
+	const u64 hdr_size = sizeof(struct nvmf_disc_rsp_page_hdr);
+	const u64 entry_size = sizeof(struct nvmf_disc_rsp_page_entry);
+	struct topo_snapshot *snap;
+	struct topo_host *host;
+	struct iovec *iov;
+	u64 log_len, start = qe->data_pos, end, pos;
+	int idx, i, first, last, nr_iov = 0;
+
+	snap = topology_pin(&idx);
+	if (!snap) {
+		topology_unpin(idx);
+		ctrl_err(ep, "no discovery topology");
+		return 0;
+	}
+	host = topology_host_page(snap, ep->ctrl->nqn);
+	topology_get(snap);
+	topology_unpin(idx);
+
+	log_len = hdr_size + host->nr_entries * entry_size;
+	if (start >= log_len) {
+		ctrl_err(ep, "offset %llu beyond log page size %llu",
+			 start, log_len);
+		topology_put(snap);
+		return 0;
+	}
+	end = start + qe->data_len;
+	if (end > log_len || end < start)
+		end = log_len;
+
+	/* Entries overlapping [start, end) */
+	first = start < hdr_size ? 0 : (start - hdr_size) / entry_size;
+	last = end <= hdr_size ? -1 : (end - hdr_size - 1) / entry_size;
+
+	iov = malloc((last - first + 2) * sizeof(struct iovec));
+	if (!iov) {
 		ctrl_err(ep, "error allocating discovery log");
-		errno = ENOMEM;
-		return -1;
-	}
-	memset(log_buf, 0, log_len);
-	log_hdr = (struct nvmf_disc_rsp_page_hdr *)log_buf;
-	log_ptr = log_hdr->entries;
-
-	if (num_recs) {
-		len = discdb_host_disc_entries(ep->ctrl->nqn,
-					       (u8 *)log_ptr, len);
-		if (len < 0) {
-			ctrl_err(ep, "error fetching discovery log entries");
-			num_recs = 0;
+		topology_put(snap);
+		return 0;
+	}
+	if (start < hdr_size) {
+		iov[nr_iov].iov_base = (u8 *)host->hdr + start;
+		iov[nr_iov].iov_len = (end < hdr_size ? end : hdr_size) - start;
+		nr_iov++;
+	}
+	for (i = first; i <= last; i++) {
+		pos = hdr_size + i * entry_size;
+		iov[nr_iov].iov_base = host->entries[i];
+		iov[nr_iov].iov_len = entry_size;
+		if (pos < start) {
+			iov[nr_iov].iov_base = (u8 *)iov[nr_iov].iov_base +
+				start - pos;
+			iov[nr_iov].iov_len -= start - pos;
 		}
+		if (pos + entry_size > end)
+			iov[nr_iov].iov_len -= pos + entry_size - end;
+		nr_iov++;
 	}
 
-	genctr = discdb_host_genctr(ep->ctrl->nqn);
-	if (genctr < 0) {
-		ctrl_err(ep, "error retrieving genctr");
-		genctr = 0;
-	}
-	log_hdr->recfmt = 1;
-	log_hdr->numrec = htole64(num_recs);
-	log_hdr->genctr = htole64(genctr);
-	if (log_len < data_offset) {
-		ctrl_err(ep, "offset %llu beyond log page size %d",
-			 data_offset, log_len);
-		log_len = 0;
+	qe->data_iov = iov;
+	qe->data_iovcnt = nr_iov;
+	qe->data_iov_idx = 0;
+	qe->data_put = disc_log_put;
+	qe->data_ref = snap;
+
+	if (last < first) {
+		ctrl_info(ep, "discovery log page header only, %d entries offset %llu len %llu",
+			  host->nr_entries, start, end - start);
 	} else {
-		log_len -= data_offset;
-		if (log_len > data_len)
-			log_len = data_len;
-		memcpy(data, log_buf + data_offset, log_len);
-	}
-	ctrl_info(ep, "discovery log page entries %d offset %llu len %d",
-		  num_recs, data_offset, log_len);
-	free(log_buf);
-	return log_len;
+		ctrl_info(ep, "discovery log page entries %d-%d of %d offset %llu len %llu",
+			  first, last, host->nr_entries, start, end - start);
+	}
+	return end - start;
 }
 
-static int handle_get_log_page(struct endpoint *ep, struct ep_qe *qe,
-			       struct nvme_command *cmd)
+/*
+ * Build the log page to be sent; runs on a worker thread
+ * when workers are enabled. The number of bytes to transfer is left
+ * in qe->xfer_len.
+ */
+static int format_log_page(struct endpoint *ep, struct ep_qe *qe)
 {
-	int ret = 0, log_len;
-	u64 offset = le64toh(cmd->get_log_page.lpo);
+	struct nvme_command *cmd = &qe->pdu.cmd.cmd;
+	int log_len;
 
-	ctrl_info(ep, "nvme_get_log_page opcode %02x lid %02x offset %lu len %lu",
-		  cmd->get_log_page.opcode, cmd->get_log_page.lid,
-		  (unsigned long)offset, (unsigned long)qe->data_len);
-
-	qe->data_pos = offset;
 	switch (cmd->get_log_page.lid) {
 	case 0x02:
 		/* SMART Log */
@@ -393,8 +606,14 @@ static int handle_get_log_page(struct endpoint *ep, struct ep_qe *qe,
 		break;
 	case 0x70:
 		/* Discovery log */
-		log_len = format_disc_log(qe->data, qe->data_pos,
-					  qe->data_len, ep);
+		if (!(cmd->get_log_page.lsp & NVME_LOG_RAE)) {
+			/* Unmasked before the snapshot is pinned */
+			pthread_mutex_lock(&ctrl_mutex);
+			ep->ctrl->aen_pending = false;
+			ep->ctrl->aen_masked = false;
+			pthread_mutex_unlock(&ctrl_mutex);
+		}
+		log_len = format_disc_log(ep, qe);
 		if (!log_len) {
 			ctrl_err(ep, "get_log_page: discovery log failed");
 			return NVME_SC_INTERNAL;
@@ -405,24 +624,78 @@ static int handle_get_log_page(struct endpoint *ep, struct ep_qe *qe,
 			cmd->get_log_page.lid);
 		return NVME_SC_INVALID_FIELD;
 	}
-	ret = tcp_send_data(ep, qe, log_len);
+	qe->xfer_len = log_len;
+	return 0;
+}
+
+static int handle_get_log_page(struct endpoint *ep, struct ep_qe *qe,
+			       struct nvme_command *cmd)
+{
+	int ret = 0;
+	u64 offset = le64toh(cmd->get_log_page.lpo);
+
+	ctrl_info(ep, "nvme_get_log_page opcode %02x lid %02x offset %lu len %lu",
+		  cmd->get_log_page.opcode, cmd->get_log_page.lid,
+		  (unsigned long)offset, (unsigned long)qe->data_len);
+
+	qe->data_pos = offset;
+	/* Completed from handle_work_done() */
+	if (!worker_queue(qe, format_log_page))
+		return 0;
+
+	ret = format_log_page(ep, qe);
+	if (ret)
+		return ret;
+	ret = tcp_send_data(ep, qe, qe->xfer_len);
 	if (ret)
-		ctrl_err(ep, "tcp_send_data failed with %d", errno);
+		ctrl_err(ep, "tcp_send_data failed with %d", ret);
+
+	return ret;
+}
+
+/*
+ * Complete a command executed on a worker thread; called from the
+ * reactor owning the endpoint.
+ */
+int handle_work_done(struct endpoint *ep, struct ep_qe *qe)
+{
+	int ret;
+
+	if (qe->work_status ||
+	    qe->pdu.cmd.cmd.common.opcode == nvme_admin_async_event)
+		return send_response(ep, qe, qe->work_status);
 
+	ret = tcp_send_data(ep, qe, qe->xfer_len);
+	if (ret)
+		ctrl_err(ep, "tcp_send_data failed with %d", ret);
 	return ret;
 }
 
 int handle_request(struct endpoint *ep, struct nvme_command *cmd)
 {
 	struct ep_qe *qe;
-	u32 len;
+	bool oversized = false;
+	u32 len, buf_len;
 	u16 ccid;
 	int ret;
 
 	len = le32toh(cmd->common.dptr.sgl.length);
 	/* ccid is considered opaque; no endian conversion */
 	ccid = cmd->common.command_id;
-	qe = tcp_acquire_tag(ep, ep->recv_pdu, ccid, 0, len);
+	if (ep->mdts && len > ep->mdts) {
+		ctrl_err(ep, "ccid %#x len %u exceeds mdts %d",
+			 ccid, len, ep->mdts);
+		/* No data buffer; any in-capsule data terminates the link */
+		oversized = true;
+		len = 0;
+	}
+	/* The discovery log is sent from the topology snapshot */
+	if (!ep->qid && cmd->common.opcode == nvme_admin_get_log_page &&
+	    cmd->get_log_page.lid == NVME_LOG_DISC)
+		buf_len = 0;
+	else
+		buf_len = len;
+	qe = tcp_acquire_tag(ep, ep->recv_pdu, ccid, 0, buf_len);
 	if (!qe) {
 		struct nvme_completion resp = {
 			.status = NVME_SC_NS_NOT_READY,
@@ -430,8 +703,27 @@ int handle_request(struct endpoint *ep, struct nvme_command *cmd)
 		};
 
 		ctrl_err(ep, "ccid %#x queue busy", ccid);
-		return tcp_send_rsp(ep, &resp);
+		return tcp_send_rsp(ep, &resp, NULL);
 	}
+	/* Bounds the transfer even without a buffer */
+	qe->data_len = len;
+	ret = tcp_recv_incapsule_data(ep, qe);
+	if (ret)
+		return ret < 0 ? ret : 0;
+	if (oversized)
+		return send_response(ep, qe, NVME_SC_INVALID_FIELD);
+
+	return handle_command(ep, qe);
+}
+
+/*
+ * Execute a command once all of its in-capsule data has been received.
+ */
+int handle_command(struct endpoint *ep, struct ep_qe *qe)
+{
+	struct nvme_command *cmd = &qe->pdu.cmd.cmd;
+	int ret;
+
 	memset(&qe->resp, 0, sizeof(qe->resp));
 	if (cmd->common.opcode == nvme_fabrics_command) {
 		switch (cmd->fabrics.fctype) {
@@ -442,7 +734,7 @@ int handle_request(struct endpoint *ep, struct nvme_command *cmd)
 			ret = handle_property_get(ep, qe, cmd);
 			break;
 		case nvme_fabrics_type_connect:
-			ret = handle_connect(ep, qe, cmd);
+			ret = handle_connect(ep, &qe, cmd);
 			break;
 		default:
 			ctrl_err(ep, "unknown fctype %d",
@@ -465,6 +757,10 @@ int handle_request(struct endpoint *ep, struct nvme_command *cmd)
 		ret = handle_get_log_page(ep, qe, cmd);
 		if (!ret)
 			return 0;
+	} else if (cmd->common.opcode == nvme_admin_async_event) {
+		ret = handle_async_event(ep, qe);
+		if (!ret)
+			return 0;
 	} else if (cmd->common.opcode == nvme_admin_set_features) {
 		ret = handle_set_features(ep, qe, cmd);
 		if (ret)
@@ -28,6 +28,7 @@
 #define NVMF_DQ_DEPTH		2
 #define NVMF_SQ_DEPTH		128
 #define NVMF_NUM_QUEUES		8
+#define NVMF_NR_AER		4
 
 #define MAX_NQN_SIZE		256
 #define MAX_ALIAS_SIZE		64
@@ -76,33 +77,88 @@ struct ep_qe {
 	void *data;
 	u64 data_len;
 	u64 data_pos;
+	/*
+	 * Optional gather list sent instead of 'data', freed with the
+	 * tag; 'data_put' drops the reference on what it points to.
+	 */
+	struct iovec *data_iov;
+	int data_iovcnt;
+	int data_iov_idx;
+	void (*data_put)(void *ref);
+	void *data_ref;
 	u64 data_remaining;
 	u64 iovec_offset;
+	u64 recv_offset;
+	u64 recv_len;
 	int ccid;
 	int opcode;
 	bool busy;
+	/* Deferred execution on a worker thread */
+	struct list_head work_node;
+	int (*work)(struct endpoint *ep, struct ep_qe *qe);
+	int work_status;
+	u64 xfer_len;
 };
 
-enum { RECV_PDU, RECV_DATA, HANDLE_PDU };
+/* Outbound PDU, header copied and data referenced */
+struct ep_send {
+	struct list_head node;
+	struct ep_qe *qe;
+	u32 ddgst;
+	bool zc;	/* referenced by a MSG_ZEROCOPY send */
+	u32 zc_seq;
+	u8 *hdr;	/* stored behind iov[] */
+	int nr_iov;
+	struct iovec iov[];	/* header (+ digest), data, data digest */
+};
+
+enum { RECV_TLS, RECV_ICREQ, RECV_PDU, RECV_DATA, HANDLE_PDU };
 
 struct endpoint {
 	struct list_head node;
-	pthread_t pthread;
+	struct list_head reactor_node;
+	struct reactor *reactor;
 	struct interface *iface;
 	struct ctrl_conn *ctrl;
 	struct ep_qe *qes;
+	u64 *tag_map;
 	union nvme_tcp_pdu *recv_pdu;
-	int recv_pdu_len;
+	union nvme_tcp_pdu *recv_hdr;
 	union nvme_tcp_pdu *send_pdu;
+	struct ep_qe *recv_qe;
 	int recv_state;
 	int qsize;
 	int qid;
 	int kato_countdown;
 	int kato_interval;
+	bool kato_reset;
 	int sockfd;
 	int maxr2t;
 	int maxh2cdata;
+	int maxc2hdata;
 	int mdts;
+	bool hdr_digest;
+	bool data_digest;
+	u32 recv_ddgst;
+	struct gnutls_session_int *tls_session;
+	bool tls_ktls;
+	u8 *rx_buf;
+	size_t rx_size;
+	size_t rx_head;
+	size_t rx_tail;
+	struct list_head send_list;
+	bool pollout;
+	bool zerocopy;
+	u32 zc_seq;
+	struct list_head zc_list;
+	int uring_slot;
+	int uring_tx_inflight;
+	bool uring_recv_armed;
+	bool uring_dying;
+	int nr_work;
+	bool closing;
+	bool release_pending;
+	bool handshake;
 };
 
 struct ctrl_conn {
@@ -114,32 +170,92 @@ struct ctrl_conn {
 	int num_endpoints;
 	int max_endpoints;
 	int aen_mask;
+	/*
+	 * Outstanding Asynchronous Event Requests, linked by work_node
+	 * and protected by ctrl_mutex. A discovery log change is
+	 * masked once reported until the host reads the log page.
+	 */
+	struct list_head aer_list;
+	int nr_aer;
+	bool aen_pending;
+	bool aen_masked;
 	u64 csts;
 	u64 cc;
 };
 
 struct interface {
 	struct list_head node;
-	pthread_t pthread;
 	struct etcd_cdc_ctx *ctx;
 	struct list_head ep_list;
 	pthread_mutex_t ep_mutex;
+	pthread_cond_t ep_cond;
 	struct nvmet_port port;
 	sa_family_t adrfam;
 	int portid;
-	int listenfd;
+	int *listenfd;
+	int nr_listeners;
+	int epollfd;
+	int numa_node;
 	unsigned char *tls_key;
 	size_t tls_key_len;
 };
 
+#define POOL_MIN_SIZE		1024
+#define POOL_NR_CLASSES		8	/* 1k .. 128k */
+
+struct buf_pool {
+	void *free_list[POOL_NR_CLASSES];
+	size_t cached;
+	size_t max_cached;
+};
+
+struct reactor {
+	pthread_t pthread;
+	int id;
+	int epollfd;
+	int eventfd;
+	struct uring *uring;
+	struct buf_pool pool;
+	pthread_mutex_t lock;
+	struct list_head pending;
+	struct list_head ep_list;
+	struct list_head done;
+	int nr_endpoints;
+	int spin;
+	int node;
+	bool stopping;
+};
+
 struct etcd_cdc_ctx {
 	char *proto;
 	int port;
 	char *configfs;
 	char *dbfile;
 	int ttl;
+	int nr_reactors;
+	int nr_workers;
+	int nr_listeners;
+	int backlog;
+	int max_handshakes;
+	int fastopen;
+	int defer_accept;
+	int busy_poll;
+	int spin;
+	int *cpus;
+	int nr_cpus;
+	int numa;
+	char *unix_path;
+	int max_host_ctrls;
+	int io_uring;
+	size_t pool_size;
+	size_t zc_threshold;
+	size_t mdts;
+	size_t maxdata;
 	int debug;
 	int tls;
+	char *tls_keyfile;
+	unsigned char *tls_key;
+	size_t tls_key_len;
 	struct nvmet_host host;
 	struct nvmet_subsys subsys;
 };
@@ -158,10 +274,31 @@ static inline void set_response(struct nvme_completion *resp,
 
 void handle_disconnect(struct endpoint *ep, int shutdown);
 int handle_request(struct endpoint *ep, struct nvme_command *cmd);
+int handle_command(struct endpoint *ep, struct ep_qe *qe);
 int handle_data(struct endpoint *ep, struct ep_qe *qe, int res);
-int endpoint_update_qdepth(struct endpoint *ep, int qsize);
+int handle_work_done(struct endpoint *ep, struct ep_qe *qe);
+void handle_aer_abort(struct endpoint *ep);
+struct topo_snapshot;
+void handle_disc_change(struct topo_snapshot *old,
+			struct topo_snapshot *snap);
+int endpoint_update_qdepth(struct endpoint *ep, struct ep_qe **qe, int qsize);
+
+/* Admission control counters, see interface.c */
+struct admission_stats {
+	unsigned long accepted;
+	unsigned long deferred;
+	unsigned long host_rejected;
+	int handshakes;
+	int handshakes_peak;
+};
+
+extern struct admission_stats admission_stats;
 
+int interface_init(struct etcd_cdc_ctx *ctx);
+void interface_handshake_done(struct endpoint *ep);
+void interface_show_stats(void);
 int interface_create(struct etcd_cdc_ctx *ctx, struct nvmet_port *port);
+int interface_create_unix(struct etcd_cdc_ctx *ctx, const char *path);
 void interface_delete(struct etcd_cdc_ctx *ctx, struct nvmet_port *port);
 void interface_stop(void);
 
@@ -0,0 +1,237 @@
+/*
+ * crc32c.c
+ * CRC32C (Castagnoli) as used for NVMe/TCP header and data digests
+ *
+ * Uses the SSE4.2 crc32 instruction if the CPU supports it, and a
+ * slicing-by-8 table lookup otherwise. With PCLMULQDQ, larger buffers
+ * are split into three lanes which are run through crc32 in parallel,
+ * hiding its three cycle latency, and the lane CRCs are merged with
+ * carry-less multiplications.
+ */
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "crc32c.h"
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#include <wmmintrin.h>
+#endif
+
+#define ARRAY_SIZE(a)	(int)(sizeof(a) / sizeof((a)[0]))
+
+#define CRC32C_POLY	0x82f63b78	/* reflected */
+
+/* Lane lengths for the three-way split; multiples of 8 */
+#define CRC32C_LONG	2048
+#define CRC32C_SHORT	256
+
+static u32 crc32c_table[8][256];
+static u32 (*crc32c_fn)(u32 crc, const u8 *p, size_t len);
+
+static u32 crc32c_sw(u32 crc, const u8 *p, size_t len)
+{
+	u64 v;
+
+	while (len && ((uintptr_t)p & 7)) {
+		crc = crc32c_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+		len--;
+	}
+	while (len >= 8) {
+		memcpy(&v, p, sizeof(v));
+		v ^= crc;
+		crc = crc32c_table[7][v & 0xff] ^
+			crc32c_table[6][(v >> 8) & 0xff] ^
+			crc32c_table[5][(v >> 16) & 0xff] ^
+			crc32c_table[4][(v >> 24) & 0xff] ^
+			crc32c_table[3][(v >> 32) & 0xff] ^
+			crc32c_table[2][(v >> 40) & 0xff] ^
+			crc32c_table[1][(v >> 48) & 0xff] ^
+			crc32c_table[0][v >> 56];
+		p += 8;
+		len -= 8;
+	}
+	while (len--)
+		crc = crc32c_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+	return crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static u32 crc32c_sse42(u32 crc, const u8 *p, size_t len)
+{
+	u64 v, c = crc;
+
+	while (len && ((uintptr_t)p & 7)) {
+		c = _mm_crc32_u8(c, *p++);
+		len--;
+	}
+	while (len >= 8) {
+		memcpy(&v, p, sizeof(v));
+		c = _mm_crc32_u64(c, v);
+		p += 8;
+		len -= 8;
+	}
+	while (len--)
+		c = _mm_crc32_u8(c, *p++);
+	return c;
+}
+
+/*
+ * Multipliers to advance a lane CRC over the @len bytes of the lanes
+ * following it, see crc32c_lanes(): x^(8 * len - 33) mod P, bit
+ * reflected.
+ */
+static u32 crc32c_k_long[2], crc32c_k_short[2];
+
+static u32 crc32c_xpow(size_t len)
+{
+	u32 k = 0x80000000;	/* x^0 */
+	size_t n;
+
+	for (n = 0; n < 8 * len - 33; n++)
+		k = (k >> 1) ^ (k & 1 ? CRC32C_POLY : 0);
+	return k;
+}
+
+/*
+ * crc32 of the 64-bit carry-less product of @crc and @k; the product
+ * carries an extra factor x, and crc32 multiplies by x^32 when
+ * reducing it, hence the 33 in crc32c_xpow().
+ */
+__attribute__((target("sse4.2,pclmul")))
+static u64 crc32c_clmul(u32 crc, u32 k)
+{
+	__m128i r = _mm_clmulepi64_si128(_mm_cvtsi32_si128(crc),
+					 _mm_cvtsi32_si128(k), 0);
+
+	return _mm_cvtsi128_si64(r);
+}
+
+__attribute__((target("sse4.2,pclmul")))
+static u64 crc32c_lanes(u64 c0, const u8 *p, size_t lane, const u32 *k)
+{
+	u64 c1 = 0, c2 = 0, v0, v1, v2;
+	size_t i;
+
+	for (i = 0; i < lane; i += 8) {
+		memcpy(&v0, p + i, sizeof(v0));
+		memcpy(&v1, p + lane + i, sizeof(v1));
+		memcpy(&v2, p + 2 * lane + i, sizeof(v2));
+		c0 = _mm_crc32_u64(c0, v0);
+		c1 = _mm_crc32_u64(c1, v1);
+		c2 = _mm_crc32_u64(c2, v2);
+	}
+	return _mm_crc32_u64(0, crc32c_clmul(c0, k[1]) ^
+			     crc32c_clmul(c1, k[0])) ^ c2;
+}
+
+__attribute__((target("sse4.2,pclmul")))
+static u32 crc32c_pclmul(u32 crc, const u8 *p, size_t len)
+{
+	u64 c = crc;
+
+	while (len && ((uintptr_t)p & 7)) {
+		c = _mm_crc32_u8(c, *p++);
+		len--;
+	}
+	while (len >= 3 * CRC32C_LONG) {
+		c = crc32c_lanes(c, p, CRC32C_LONG, crc32c_k_long);
+		p += 3 * CRC32C_LONG;
+		len -= 3 * CRC32C_LONG;
+	}
+	while (len >= 3 * CRC32C_SHORT) {
+		c = crc32c_lanes(c, p, CRC32C_SHORT, crc32c_k_short);
+		p += 3 * CRC32C_SHORT;
+		len -= 3 * CRC32C_SHORT;
+	}
+	return crc32c_sse42(c, p, len);
+}
+#endif
+
+static const struct {
+	const char *name;
+	u32 (*fn)(u32 crc, const u8 *p, size_t len);
+} crc32c_impls[] = {
+	{ "table-driven", crc32c_sw },
+#if defined(__x86_64__)
+	{ "sse4.2", crc32c_sse42 },
+	{ "pclmul", crc32c_pclmul },
+#endif
+};
+
+static bool crc32c_supported(int i)
+{
+#if defined(__x86_64__)
+	if (crc32c_impls[i].fn == crc32c_sse42)
+		return __builtin_cpu_supports("sse4.2");
+	if (crc32c_impls[i].fn == crc32c_pclmul)
+		return __builtin_cpu_supports("sse4.2") &&
+			__builtin_cpu_supports("pclmul");
+#endif
+	return true;
+}
+
+void crc32c_init(void)
+{
+	u32 crc;
+	int i, j;
+
+	for (i = 0; i < 256; i++) {
+		crc = i;
+		for (j = 0; j < 8; j++)
+			crc = (crc >> 1) ^ (crc & 1 ? CRC32C_POLY : 0);
+		crc32c_table[0][i] = crc;
+	}
+	for (i = 0; i < 256; i++) {
+		crc = crc32c_table[0][i];
+		for (j = 1; j < 8; j++) {
+			crc = crc32c_table[0][crc & 0xff] ^ (crc >> 8);
+			crc32c_table[j][i] = crc;
+		}
+	}
+
+#if defined(__x86_64__)
+	crc32c_k_long[0] = crc32c_xpow(CRC32C_LONG);
+	crc32c_k_long[1] = crc32c_xpow(2 * CRC32C_LONG);
+	crc32c_k_short[0] = crc32c_xpow(CRC32C_SHORT);
+	crc32c_k_short[1] = crc32c_xpow(2 * CRC32C_SHORT);
+#endif
+
+	/* The fastest one supported comes last */
+	for (i = ARRAY_SIZE(crc32c_impls) - 1; i > 0; i--) {
+		if (crc32c_supported(i))
+			break;
+	}
+	crc32c_fn = crc32c_impls[i].fn;
+	printf("using %s crc32c\n", crc32c_impls[i].name);
+}
+
+/*
+ * Switch to the implementation called @name, for benchmarking.
+ */
+int crc32c_select(const char *name)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(crc32c_impls); i++) {
+		if (strcmp(crc32c_impls[i].name, name))
+			continue;
+		if (!crc32c_supported(i))
+			return -ENOTSUP;
+		crc32c_fn = crc32c_impls[i].fn;
+		return 0;
+	}
+	return -ENOENT;
+}
+
+/*
+ * Continue the CRC32C @crc over @len bytes of @buf; start with 0.
+ */
+u32 crc32c(u32 crc, const void *buf, size_t len)
+{
+	return ~crc32c_fn(~crc, buf, len);
+}
@@ -0,0 +1,11 @@
+#ifndef _NVMET_CRC32C_H
+#define _NVMET_CRC32C_H
+
+#include <stddef.h>
+#include "types.h"
+
+void crc32c_init(void);
+int crc32c_select(const char *name);
+u32 crc32c(u32 crc, const void *buf, size_t len);
+
+#endif /* _NVMET_CRC32C_H */
@@ -31,12 +31,20 @@
 #include <dirent.h>
 #include <getopt.h>
 #include <sys/types.h>
+#include <sys/socket.h>
 #include <fcntl.h>
 
 #include <sys/inotify.h>
 
 #include "common.h"
 #include "discdb.h"
+#include "logcache.h"
+#include "reactor.h"
+#include "affinity.h"
+#include "crc32c.h"
+#include "tls.h"
+#include "topology.h"
+#include "worker.h"
 
 static char *default_configfs = "/sys/kernel/config/nvmet";
 static char *default_dbfile = "nvme_discdb.sqlite";
@@ -62,6 +70,11 @@ void *signal_loop(void *arg)
 			break;
 		}
 		switch (signo) {
+		case SIGUSR1:
+			interface_show_stats();
+			topology_show_stats();
+			logcache_show_stats();
+			break;
 		case SIGINT:
 		case SIGTERM:
 			printf("interrupted\n");
@@ -85,30 +98,110 @@ int parse_opts(struct etcd_cdc_ctx *ctx, int argc, char *argv[])
 		{"configfs", required_argument, 0, 'c'},
 		{"port", required_argument, 0, 'p'},
 		{"tls", no_argument, 0, 't'},
+		{"tls-key", required_argument, 0, 'k'},
 		{"nqn", required_argument, 0, 'n'},
+		{"reactors", required_argument, 0, 'r'},
+		{"workers", required_argument, 0, 'w'},
+		{"io-uring", no_argument, 0, 'u'},
+		{"buffer-cache", required_argument, 0, 'b'},
+		{"zerocopy", required_argument, 0, 'z'},
+		{"mdts", required_argument, 0, 'm'},
+		{"maxdata", required_argument, 0, 'd'},
+		{"listeners", required_argument, 0, 'l'},
+		{"backlog", required_argument, 0, 'q'},
+		{"fastopen", required_argument, 0, 'f'},
+		{"defer-accept", required_argument, 0, 'y'},
+		{"busy-poll", required_argument, 0, 'x'},
+		{"spin", required_argument, 0, 'i'},
+		{"cpus", required_argument, 0, 'g'},
+		{"numa", no_argument, 0, 'j'},
+		{"unix", required_argument, 0, 'U'},
+		{"max-handshakes", required_argument, 0, 'a'},
+		{"max-host-ctrls", required_argument, 0, 'o'},
 		{"verbose", no_argument, 0, 'v'},
+		{0, 0, 0, 0},
 	};
 	char c;
-	int getopt_ind;
+	int getopt_ind, ret;
 
-	while ((c = getopt_long(argc, argv, "c:e:n:p:st:v",
+	while ((c = getopt_long(argc, argv, "a:b:c:d:e:f:g:i:jk:l:m:n:o:p:q:r:stuU:vw:x:y:z:",
 				getopt_arg, &getopt_ind)) != -1) {
 		switch (c) {
+		case 'a':
+			ctx->max_handshakes = atoi(optarg);
+			break;
+		case 'b':
+			ctx->pool_size = strtoul(optarg, NULL, 10) * 1024;
+			break;
 		case 'c':
 			ctx->configfs = optarg;
 			break;
+		case 'd':
+			ctx->maxdata = strtoul(optarg, NULL, 10) * 1024;
+			break;
+		case 'f':
+			ctx->fastopen = atoi(optarg);
+			break;
+		case 'g':
+			ret = affinity_parse_cpus(optarg, &ctx->cpus);
+			if (ret < 0)
+				return ret;
+			ctx->nr_cpus = ret;
+			break;
+		case 'i':
+			ctx->spin = atoi(optarg);
+			break;
+		case 'j':
+			ctx->numa = 1;
+			break;
+		case 'k':
+			ctx->tls_keyfile = optarg;
+			break;
+		case 'l':
+			ctx->nr_listeners = atoi(optarg);
+			break;
+		case 'm':
+			ctx->mdts = strtoul(optarg, NULL, 10) * 1024;
+			break;
 		case 'n':
 			strcpy(ctx->subsys.subsysnqn, optarg);
 			break;
+		case 'o':
+			ctx->max_host_ctrls = atoi(optarg);
+			break;
 		case 'p':
 			ctx->port = atoi(optarg);
 			break;
+		case 'q':
+			ctx->backlog = atoi(optarg);
+			break;
+		case 'r':
+			ctx->nr_reactors = atoi(optarg);
+			break;
 		case 't':
 			ctx->tls++;
 			break;
+		case 'u':
+			ctx->io_uring = 1;
+			break;
+		case 'U':
+			ctx->unix_path = optarg;
+			break;
 		case 'v':
 			ctx->debug++;
 			break;
+		case 'w':
+			ctx->nr_workers = atoi(optarg);
+			break;
+		case 'x':
+			ctx->busy_poll = atoi(optarg);
+			break;
+		case 'y':
+			ctx->defer_accept = atoi(optarg);
+			break;
+		case 'z':
+			ctx->zc_threshold = strtoul(optarg, NULL, 10) * 1024;
+			break;
 		}
 	}
 	return 0;
@@ -131,21 +224,47 @@ int main (int argc, char *argv[])
 	ctx->ttl = 10;
 	ctx->dbfile = default_dbfile;
 	ctx->port = 8009;
+	ctx->nr_reactors = sysconf(_SC_NPROCESSORS_ONLN);
+	ctx->nr_workers = 2;
+	ctx->pool_size = 1024 * 1024;
+	ctx->nr_listeners = 1;
+	ctx->backlog = SOMAXCONN;
+	ctx->max_handshakes = 256;
 	strcpy(ctx->host.hostnqn, NVME_DISC_SUBSYS_NAME);
 	strcpy(ctx->subsys.subsysnqn, NVME_DISC_SUBSYS_NAME);
 
-	parse_opts(ctx, argc, argv);
+	if (parse_opts(ctx, argc, argv) < 0) {
+		ret = 1;
+		goto out_free_ctx;
+	}
+
+	/* MDTS is advertised as a power of two multiple of 4k */
+	if (ctx->mdts) {
+		size_t mdts = 4096;
+
+		while (mdts * 2 <= ctx->mdts)
+			mdts *= 2;
+		ctx->mdts = mdts;
+	}
+	/* MAXH2CDATA must be at least 4k */
+	if (ctx->maxdata && ctx->maxdata < 4096)
+		ctx->maxdata = 4096;
 
 	if (ctx->debug)
 		cmd_debug = 1;
 	if (ctx->debug > 1)
 		tcp_debug = 1;
 
-	if (discdb_open(ctx->dbfile)) {
+	if (tls_init(ctx) < 0) {
 		ret = 1;
 		goto out_free_ctx;
 	}
 
+	if (discdb_open(ctx->dbfile)) {
+		ret = 1;
+		goto out_tls_exit;
+	}
+
 	if (discdb_add_host(&ctx->host) < 0) {
 		fprintf(stderr, "failed to insert default host %s\n",
 			ctx->host.hostnqn);
@@ -157,10 +276,12 @@ int main (int argc, char *argv[])
 		goto out_del_host;
 	}
 	discdb_add_host_subsys(&ctx->host, &ctx->subsys);
+	discdb_publish();
 
 	sigemptyset(&sigmask);
 	sigaddset(&sigmask, SIGINT);
 	sigaddset(&sigmask, SIGTERM);
+	sigaddset(&sigmask, SIGUSR1);
 
 	if (pthread_sigmask(SIG_BLOCK, &sigmask, NULL) < 0) {
 		fprintf(stderr, "Couldn't block signals, error %d\n", errno);
@@ -175,6 +296,44 @@ int main (int argc, char *argv[])
 		goto out_del_subsys;
 	}
 
+	crc32c_init();
+
+	ret = worker_init(ctx);
+	if (ret) {
+		fprintf(stderr, "failed to start workers: %d\n", ret);
+		ret = 1;
+		pthread_kill(signal_thread, SIGTERM);
+		goto out_join;
+	}
+
+	ret = reactor_init(ctx);
+	if (ret) {
+		fprintf(stderr, "failed to start reactors: %d\n", ret);
+		ret = 1;
+		pthread_kill(signal_thread, SIGTERM);
+		goto out_worker;
+	}
+
+	ret = interface_init(ctx);
+	if (ret) {
+		fprintf(stderr, "failed to start acceptor: %d\n", ret);
+		ret = 1;
+		pthread_kill(signal_thread, SIGTERM);
+		goto out_reactor;
+	}
+
+	if (ctx->unix_path) {
+		ret = interface_create_unix(ctx, ctx->unix_path);
+		if (ret) {
+			fprintf(stderr, "failed to create unix listener: %d\n",
+				ret);
+			ret = 1;
+			pthread_kill(signal_thread, SIGTERM);
+			interface_stop();
+			goto out_reactor;
+		}
+	}
+
 	pthread_attr_init(&pthread_attr);
 	ret = pthread_create(&inotify_thread, &pthread_attr,
 			     inotify_loop, ctx);
@@ -184,7 +343,8 @@ int main (int argc, char *argv[])
 		fprintf(stderr, "failed to create inotify pthread: %d\n", ret);
 		ret = 1;
 		pthread_kill(signal_thread, SIGTERM);
-		goto out_join;
+		interface_stop();
+		goto out_reactor;
 	}
 
 	pthread_mutex_lock(&signal_lock);
@@ -196,6 +356,10 @@ int main (int argc, char *argv[])
 
 	pthread_kill(inotify_thread, SIGTERM);
 	pthread_join(inotify_thread, NULL);
+out_reactor:
+	reactor_exit();
+out_worker:
+	worker_exit();
 out_join:
 	pthread_join(signal_thread, NULL);
 out_del_subsys:
@@ -205,7 +369,12 @@ out_del_host:
 	discdb_del_host(&ctx->host);
 out_close_db:
 	discdb_close(ctx->dbfile);
+	topology_exit();
+	logcache_exit();
+out_tls_exit:
+	tls_exit(ctx);
 out_free_ctx:
+	free(ctx->cpus);
 	free(ctx);
 	return ret;
 }
@@ -27,9 +27,16 @@
 
 #include "common.h"
 #include "discdb.h"
+#include "logcache.h"
+#include "topology.h"
 
 static sqlite3 *nvme_db;
 
+/*
+ * Modified by the writer only; see discdb_publish().
+ */
+static bool topology_dirty;
+
 static int sql_simple_cb(void *unused, int argc, char **argv, char **colname)
 {
 	   int i;
@@ -51,6 +58,7 @@ static int sql_exec_simple(const char *sql_str)
 	int ret;
 	char *errmsg = NULL;
 
+	topology_dirty = true;
 	ret = sqlite3_exec(nvme_db, sql_str, sql_simple_cb, NULL, &errmsg);
 	if (ret != SQLITE_OK) {
 		fprintf(stderr, "SQL error executing %s\n", sql_str);
@@ -62,6 +70,37 @@ static int sql_exec_simple(const char *sql_str)
 	return ret;
 }
 
+static int sql_invalidate_cb(void *unused, int argc, char **argv,
+			     char **colname)
+{
+	if (argc > 0 && argv[0])
+		logcache_invalidate(argv[0]);
+	return 0;
+}
+
+/*
+ * Execute a genctr update which returns the NQNs of the hosts
+ * it touched, and drop the cached log pages of those hosts.
+ */
+static int sql_exec_genctr(const char *sql_str)
+{
+	int ret;
+	char *errmsg = NULL;
+
+	topology_dirty = true;
+	ret = sqlite3_exec(nvme_db, sql_str, sql_invalidate_cb, NULL, &errmsg);
+	if (ret != SQLITE_OK) {
+		fprintf(stderr, "SQL error executing %s\n", sql_str);
+		fprintf(stderr, "SQL error: %s\n", errmsg);
+		sqlite3_free(errmsg);
+		/* Cannot tell which hosts are affected */
+		logcache_invalidate_all();
+		ret = (ret == SQLITE_BUSY) ? -EBUSY : -EINVAL;
+	} else
+		ret = 0;
+	return ret;
+}
+
 struct sql_int_value_parm {
 	const char *col;
 	int val;
@@ -186,6 +225,7 @@ int discdb_del_host(struct nvmet_host *host)
 		return ret;
 	ret = sql_exec_simple(sql);
 	free(sql);
+	logcache_invalidate(host->hostnqn);
 	return ret;
 }
 
@@ -218,6 +258,7 @@ int discdb_del_subsys(struct nvmet_subsys *subsys)
 		return ret;
 	ret = sql_exec_simple(sql);
 	free(sql);
+	logcache_invalidate_all();
 	return ret;
 }
 
@@ -337,7 +378,8 @@ static char update_genctr_port_sql[] =
 	"(SELECT hs.host_id AS host_id, sp.portid AS portid "
 	"FROM host_subsys AS hs "
 	"INNER JOIN subsys_port AS sp ON hs.subsys_id = sp.subsys_id) "
-	"AS hg WHERE hg.host_id = host.id AND hg.portid = '%d';";
+	"AS hg WHERE hg.host_id = host.id AND hg.portid = '%d' "
+	"RETURNING host.nqn;";
 
 int discdb_modify_port(struct nvmet_port *port, char *attr)
 {
@@ -369,7 +411,7 @@ int discdb_modify_port(struct nvmet_port *port, char *attr)
 	ret = asprintf(&sql, update_genctr_port_sql, port->port_id);
 	if (ret < 0)
 		return ret;
-	ret = sql_exec_simple(sql);
+	ret = sql_exec_genctr(sql);
 	free(sql);
 	return ret;
 }
@@ -387,6 +429,7 @@ int discdb_del_port(struct nvmet_port *port)
 		return ret;
 	ret = sql_exec_simple(sql);
 	free(sql);
+	logcache_invalidate_all();
 	return ret;
 }
 
@@ -407,10 +450,10 @@ int discdb_add_host_subsys(struct nvmet_host *host, struct nvmet_subsys *subsys)
 	ret = sql_exec_simple(sql);
 	free(sql);
 	ret = asprintf(&sql, "UPDATE host SET genctr = genctr + 1 "
-		       "WHERE nqn LIKE '%s';", host->hostnqn);
+		       "WHERE nqn LIKE '%s' RETURNING nqn;", host->hostnqn);
 	if (ret < 0)
 		return ret;
-	ret = sql_exec_simple(sql);
+	ret = sql_exec_genctr(sql);
 	free(sql);
 	return ret;
 }
@@ -433,6 +476,12 @@ int discdb_del_host_subsys(struct nvmet_host *host, struct nvmet_subsys *subsys)
 		return ret;
 	ret = sql_exec_simple(sql);
 	free(sql);
+	ret = asprintf(&sql, "UPDATE host SET genctr = genctr + 1 "
+		       "WHERE nqn LIKE '%s' RETURNING nqn;", host->hostnqn);
+	if (ret < 0)
+		return ret;
+	ret = sql_exec_genctr(sql);
+	free(sql);
 	return ret;
 }
 
@@ -447,7 +496,8 @@ static char update_genctr_host_subsys_sql[] =
 	"(SELECT s.nqn AS subsys_nqn, hs.host_id AS host_id "
 	"FROM host_subsys AS hs "
 	"INNER JOIN subsys AS s ON s.id = hs.subsys_id) AS hs "
-	"WHERE hs.host_id = host.id AND hs.subsys_nqn LIKE '%s';";
+	"WHERE hs.host_id = host.id AND hs.subsys_nqn LIKE '%s' "
+	"RETURNING host.nqn;";
 
 int discdb_add_subsys_port(struct nvmet_subsys *subsys, struct nvmet_port *port)
 {
@@ -466,7 +516,7 @@ int discdb_add_subsys_port(struct nvmet_subsys *subsys, struct nvmet_port *port)
 	if (ret < 0)
 		return ret;
 
-	ret = sql_exec_simple(sql);
+	ret = sql_exec_genctr(sql);
 	free(sql);
 
 	return ret;
@@ -496,7 +546,7 @@ int discdb_del_subsys_port(struct nvmet_subsys *subsys, struct nvmet_port *port)
 	if (ret < 0)
 		return ret;
 
-	ret = sql_exec_simple(sql);
+	ret = sql_exec_genctr(sql);
 	free(sql);
 
 	return ret;
@@ -543,27 +593,10 @@ int discdb_count_subsys_port(struct nvmet_port *port, int trsvcid)
 	return ret;
 }
 
-struct sql_disc_entry_parm {
-	u8 *buffer;
-	int cur;
-	int len;
-};
-
-static int sql_disc_entry_cb(void *argp, int argc, char **argv, char **colname)
+static int format_disc_entry(struct nvmf_disc_rsp_page_entry *entry,
+			     int argc, char **argv, char **colname)
 {
 	int i;
-	struct sql_disc_entry_parm *parm = argp;
-	struct nvmf_disc_rsp_page_entry *entry;
-
-	if (!argp) {
-		fprintf(stderr, "%s: Invalid parameter\n", __func__);
-		return 0;
-	}
-	if (!parm->buffer)
-		goto next;
-	entry = (struct nvmf_disc_rsp_page_entry *)(parm->buffer + parm->cur);
-	if (parm->cur >= parm->len)
-		goto next;
 
 	memset(entry, 0, sizeof(*entry));
 	entry->cntlid = (u16)NVME_CNTLID_DYNAMIC;
@@ -653,6 +686,8 @@ static int sql_disc_entry_cb(void *argp, int argc, char **argv, char **colname)
 				entry->tsas.tcp.sectype =
 					NVMF_TCP_SECTYPE_NONE;
 			}
+		} else if (!strcmp(colname[i], "subsys_id")) {
+			continue;
 		} else {
 			fprintf(stderr, "skip discovery type '%s'\n",
 				colname[i]);
@@ -673,93 +708,220 @@ static int sql_disc_entry_cb(void *argp, int argc, char **argv, char **colname)
 	if (!strlen(entry->traddr)) {
 		fprintf(stderr, "Empty discovery record (%d, %d)\n",
 			entry->portid, entry->trtype);
-		return 0;
+		return -ENODATA;
 	}
-next:
-	parm->cur += sizeof(struct nvmf_disc_rsp_page_entry);
 	return 0;
 }
 
-static char host_disc_entry_sql[] =
-	"SELECT s.nqn AS subsys_nqn, "
+struct topo_build {
+	struct topo_snapshot *snap;
+	/* Previous snapshot to carry unchanged log pages over from */
+	struct topo_snapshot *old;
+};
+
+static char topology_entry_sql[] =
+	"SELECT s.id AS subsys_id, s.nqn AS subsys_nqn, "
 	"p.portid, p.subtype, p.trtype, p.traddr, p.trsvcid, p.treq, p.tsas "
 	"FROM subsys_port AS sp "
 	"INNER JOIN subsys AS s ON s.id = sp.subsys_id "
-	"INNER JOIN host_subsys AS hs ON hs.subsys_id = sp.subsys_id "
+	"INNER JOIN port AS p ON sp.port_id = p.portid;";
+
+static int sql_topology_entry_cb(void *argp, int argc, char **argv,
+				 char **colname)
+{
+	struct topo_build *build = argp;
+	struct topo_entry_set *set = build->snap->set;
+	struct topo_entry *entries, *entry;
+
+	if (argc < 3 || !argv[0] || !argv[2])
+		return 0;
+	entries = realloc(set->entries,
+			  (set->nr_entries + 1) * sizeof(struct topo_entry));
+	if (!entries)
+		return SQLITE_NOMEM;
+	set->entries = entries;
+	entry = &set->entries[set->nr_entries];
+	entry->subsys_id = strtol(argv[0], NULL, 10);
+	entry->port_id = strtol(argv[2], NULL, 10);
+	if (format_disc_entry(&entry->entry, argc, argv, colname) < 0)
+		return 0;
+	set->nr_entries++;
+	return 0;
+}
+
+static char topology_host_sql[] =
+	"SELECT nqn, genctr FROM host;";
+
+static int sql_topology_host_cb(void *argp, int argc, char **argv,
+				char **colname)
+{
+	struct topo_build *build = argp;
+	struct topo_host *host;
+	u64 genctr;
+
+	if (argc < 2 || !argv[0])
+		return 0;
+	genctr = argv[1] ? strtol(argv[1], NULL, 10) : 0;
+	host = logcache_get(build->old, argv[0], genctr);
+	if (!host) {
+		host = topology_alloc_host(build->snap, argv[0]);
+		if (!host)
+			return SQLITE_NOMEM;
+		host->hdr->genctr = htole64(genctr);
+	}
+	if (topology_add_host(build->snap, host) < 0) {
+		topology_put_host(host);
+		return SQLITE_NOMEM;
+	}
+	return 0;
+}
+
+static char topology_link_sql[] =
+	"SELECT h.nqn AS host_nqn, sp.subsys_id, sp.port_id "
+	"FROM host_subsys AS hs "
 	"INNER JOIN host AS h ON hs.host_id = h.id "
-	"INNER JOIN port AS p ON sp.port_id = p.portid "
-	"WHERE h.nqn LIKE '%s';";
+	"INNER JOIN subsys_port AS sp ON hs.subsys_id = sp.subsys_id;";
 
-int discdb_host_disc_entries(const char *hostnqn, u8 *log, int log_len)
+static int topology_add_entries(struct topo_host *host,
+				struct nvmf_disc_rsp_page_entry **add,
+				int nr_add)
 {
-	struct sql_disc_entry_parm parm = {
-		.buffer = log,
-		.cur = 0,
-		.len = log_len,
-	};
-	char *sql, *errmsg;
+	struct nvmf_disc_rsp_page_entry **entries;
+
+	if (!nr_add)
+		return 0;
+	entries = realloc(host->entries, (host->nr_entries + nr_add) *
+			  sizeof(struct nvmf_disc_rsp_page_entry *));
+	if (!entries)
+		return -ENOMEM;
+	host->entries = entries;
+	memcpy(host->entries + host->nr_entries, add,
+	       nr_add * sizeof(struct nvmf_disc_rsp_page_entry *));
+	host->nr_entries += nr_add;
+	return 0;
+}
+
+static int sql_topology_link_cb(void *argp, int argc, char **argv,
+				char **colname)
+{
+	struct topo_snapshot *snap = ((struct topo_build *)argp)->snap;
+	struct nvmf_disc_rsp_page_entry *add;
+	struct topo_entry *entry;
+	struct topo_host *host;
+
+	if (argc < 3 || !argv[0] || !argv[1] || !argv[2])
+		return 0;
+	host = topology_find_host(snap, argv[0]);
+	/* Pages carried over already hold their entries */
+	if (!host || host->set != snap->set)
+		return 0;
+	entry = topology_find_entry(snap, strtol(argv[1], NULL, 10),
+				    strtol(argv[2], NULL, 10));
+	if (!entry)
+		return 0;
+	add = &entry->entry;
+	if (topology_add_entries(host, &add, 1) < 0)
+		return SQLITE_NOMEM;
+	return 0;
+}
+
+static int sql_topology_exec(const char *sql_str,
+			     int (*cb)(void *, int, char **, char **),
+			     struct topo_build *build)
+{
+	char *errmsg;
 	int ret;
 
-	ret = asprintf(&sql, host_disc_entry_sql, hostnqn);
-	if (ret < 0)
-		return ret;
-	printf("Display disc entries for %s\n", hostnqn);
-	ret = sqlite3_exec(nvme_db, sql, sql_disc_entry_cb, &parm, &errmsg);
-	if (ret != SQLITE_OK) {
-		fprintf(stderr, "SQL error executing %s\n", sql);
-		fprintf(stderr, "SQL error: %s\n", errmsg);
-		sqlite3_free(errmsg);
-	}
-	free(sql);
-	printf("disc entries: cur %d len %d\n", parm.cur, parm.len);
-	ret = asprintf(&sql, host_disc_entry_sql, NVME_DISC_SUBSYS_NAME);
-	if (ret < 0)
-		return parm.cur;
-	printf("Display disc entries for %s\n", NVME_DISC_SUBSYS_NAME);
-	ret = sqlite3_exec(nvme_db, sql, sql_disc_entry_cb, &parm, &errmsg);
+	ret = sqlite3_exec(nvme_db, sql_str, cb, build, &errmsg);
 	if (ret != SQLITE_OK) {
-		fprintf(stderr, "SQL error executing %s\n", sql);
+		fprintf(stderr, "SQL error executing %s\n", sql_str);
 		fprintf(stderr, "SQL error: %s\n", errmsg);
 		sqlite3_free(errmsg);
+		return (ret == SQLITE_BUSY) ? -EBUSY : -EINVAL;
 	}
-	free(sql);
-	printf("disc entries: cur %d len %d\n", parm.cur, parm.len);
-	return parm.cur;
+	return 0;
 }
 
-static char host_genctr_sql[] =
-	"SELECT genctr FROM host WHERE nqn LIKE '%s';";
-
-int discdb_host_genctr(const char *hostnqn)
+/*
+ * Entries for the discovery NQN are shown to every host, so they are
+ * appended to the entries of each host when its page is built.
+ * Unchanged pages are carried over from @old; see logcache.c.
+ */
+static int discdb_build_topology(struct topo_snapshot *snap,
+				 struct topo_snapshot *old)
 {
-	char *sql, *errmsg;
-	struct sql_int_value_parm parm = {
-		.col = "genctr",
-		.val = 0,
-		.done = 0,
+	struct topo_build build = {
+		.snap = snap,
+		.old = old,
 	};
-	int ret;
+	struct topo_host *host, *disc_host;
+	int i, ret;
 
-	ret = asprintf(&sql, host_genctr_sql, hostnqn);
+	ret = sql_topology_exec(topology_entry_sql,
+				sql_topology_entry_cb, &build);
 	if (ret < 0)
 		return ret;
-	ret = sqlite3_exec(nvme_db, sql, sql_int_value_cb,
-			   &parm, &errmsg);
-	if (ret != SQLITE_OK) {
-		fprintf(stderr, "SQL error executing %s\n", sql);
-		fprintf(stderr, "SQL error: %s\n", errmsg);
-		sqlite3_free(errmsg);
-		parm.done = -EINVAL;
+	topology_sort_entries(snap);
+	ret = sql_topology_exec(topology_host_sql,
+				sql_topology_host_cb, &build);
+	if (ret < 0)
+		return ret;
+	topology_sort_hosts(snap);
+	ret = sql_topology_exec(topology_link_sql,
+				sql_topology_link_cb, &build);
+	if (ret < 0)
+		return ret;
+
+	disc_host = topology_find_host(snap, NVME_DISC_SUBSYS_NAME);
+	for (i = 0; i <= snap->nr_hosts; i++) {
+		host = i < snap->nr_hosts ? snap->hosts[i] : &snap->unknown;
+		if (host->set != snap->set)
+			continue;
+		if (disc_host && host != disc_host &&
+		    topology_add_entries(host, disc_host->entries,
+					 disc_host->nr_entries) < 0)
+			return -ENOMEM;
+		host->hdr->numrec = htole64(host->nr_entries);
 	}
-	free(sql);
-	if (parm.done < 0) {
-		errno = -parm.done;
-		ret = -1;
-	} else if (!parm.done) {
+	return 0;
+}
+
+/*
+ * Publish a new topology snapshot if the database has been modified
+ * since the last call. Must be called from the thread modifying the
+ * database after each batch of changes.
+ */
+int discdb_publish(void)
+{
+	struct topo_snapshot *snap, *old;
+	int ret, idx;
+
+	if (!topology_dirty)
 		return 0;
-	} else {
-		ret = parm.val;
+	snap = topology_alloc();
+	if (!snap)
+		return -ENOMEM;
+
+	/*
+	 * Kept around to carry unchanged log pages over, and to find
+	 * the hosts whose log page has changed
+	 */
+	old = topology_pin(&idx);
+	if (old)
+		topology_get(old);
+	topology_unpin(idx);
+	ret = discdb_build_topology(snap, old);
+	if (ret < 0) {
+		topology_free(snap);
+		goto out_put;
 	}
+	topology_dirty = false;
+	logcache_reset();
+	topology_publish(snap);
+	handle_disc_change(old, snap);
+out_put:
+	if (old)
+		topology_put(old);
 	return ret;
 }
 
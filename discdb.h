@@ -24,7 +24,6 @@ int discdb_del_subsys_port(struct nvmet_subsys *subsys,
 			   struct nvmet_port *port);
 int discdb_count_subsys_port(struct nvmet_port *port, int trsvcid);
 
-int discdb_host_disc_entries(const char *hostnqn, u8 *log, int log_len);
-int discdb_host_genctr(const char *hostnqn);
+int discdb_publish(void);
 
 #endif
@@ -4,11 +4,13 @@
 #include <stdio.h>
 #include <inttypes.h>
 #include <arpa/inet.h>
-#include <sys/epoll.h>
+#include <sys/socket.h>
 
 #include "common.h"
 #include "endpoint.h"
+#include "reactor.h"
 #include "tcp.h"
+#include "tls.h"
 
 #define ep_info(e, f, x...)					\
 	if (cmd_debug) {					\
@@ -25,136 +27,120 @@
 	} while (0)
 
 
-int endpoint_update_qdepth(struct endpoint *ep, int qsize)
+/*
+ * Called from the connect command @qe, which is moved along with
+ * the queue entries.
+ */
+int endpoint_update_qdepth(struct endpoint *ep, struct ep_qe **qe, int qsize)
 {
-	struct ep_qe *qes;
-	int i;
-
 	if (qsize + 1 == ep->qsize)
 		return 0;
 
-	qes = calloc(qsize + 1, sizeof(struct ep_qe));
-	if (!qes)
-		return -1;
-	free(ep->qes);
-	ep->qes = qes;
-	for (i = 0; i <= qsize; i++) {
-		ep->qes[i].tag = i;
-		ep->qes[i].ep = ep;
-	}
-	ep->qsize = qsize + 1;
-	return 0;
+	return tcp_resize_tags(ep, qsize + 1, qe);
 }
 
-void *endpoint_thread(void *arg)
+static int endpoint_check_error(struct endpoint *ep, int ret)
 {
-	struct endpoint *ep = arg;
-	int epollfd;
-	struct epoll_event ev;
-	sigset_t set;
-	int ret;
-
-	sigemptyset(&set);
-	sigaddset(&set, SIGPIPE);
-	pthread_sigmask(SIG_BLOCK, &set, NULL);
-
-	epollfd = epoll_create(1);
-	if (epollfd < 0) {
-		ep_err(ep, "error %d creating epoll instance", errno);
-		goto out_disconnect;
-	}
-	ev.events = EPOLLIN;
-	ev.data.fd = ep->sockfd;
-	if (epoll_ctl(epollfd, EPOLL_CTL_ADD, ep->sockfd, &ev) < 0) {
-		ep_err(ep, "failed to add epoll fd, error %d", errno);
-		goto out_close;
+	if (!ret || ret == -EAGAIN) {
+		if (ep->ctrl)
+			ep->kato_countdown = ep->ctrl->kato;
+		else
+			ep->kato_countdown = RETRY_COUNT;
+		return 0;
 	}
 
-	while (!stopped) {
-		ret = epoll_wait(epollfd, &ev, 1, ep->kato_interval);
-		if (ret == 0) {
-			/* terminate on KATO */
-			if (!--ep->kato_countdown) {
-				ep_err(ep, "KATO timeout");
-				break;
-			}
-			continue;
-		}
-
-		if (ret < 0) {
-			ep_err(ep, "epoll error %d", ret);
-			break;
-		}
-		if (ev.data.fd != ep->sockfd) {
-			ep_err(ep, "epoll invalid fd %d\n", ev.data.fd);
-			continue;
-		}
-		if (ep->recv_state == RECV_PDU) {
-			ret = tcp_read_msg(ep);
-		}
-		if (!ret && ep->recv_state == HANDLE_PDU) {
-			ret = tcp_handle_msg(ep);
-			if (ret >= 0) {
-				ep->recv_pdu_len = 0;
-				ep->recv_state = RECV_PDU;
-			}
-		}
-		if (!ret || ret == -EAGAIN) {
-			if (ep->ctrl)
-				ep->kato_countdown = ep->ctrl->kato;
-			else
-				ep->kato_countdown = RETRY_COUNT;
-		}
-
-		/*
-		 * ->read_msg returns -ENODATA when the connection
-		 * is closed; that shouldn't count as an error.
-		 */
-		if (ret == -ENODATA) {
-			ep_info(ep, "connection closed");
-			break;
-		}
-		if (ret < 0) {
-			ep_err(ep, "error %d retry %d",
-			       ret, ep->kato_countdown);
-			break;
-		}
+	/*
+	 * ->read_msg returns -ENODATA when the connection
+	 * is closed; that shouldn't count as an error.
+	 */
+	if (ret == -ENODATA) {
+		ep_info(ep, "connection closed");
+	} else if (ret < 0) {
+		ep_err(ep, "error %d retry %d",
+		       ret, ep->kato_countdown);
 	}
-out_close:
-	close(epollfd);
-
-out_disconnect:
-	handle_disconnect(ep, !stopped);
+	return ret;
+}
 
-	ep_info(ep, "%s",
-		stopped ? "stopped" : "disconnected");
-	pthread_exit(NULL);
+static int endpoint_handle_pdu(struct endpoint *ep)
+{
+	int ret = 0;
 
-	return NULL;
+	if (ep->recv_state == RECV_ICREQ) {
+		ret = tcp_accept_connection(ep);
+		if (!ret)
+			ep->recv_state = RECV_PDU;
+		return ret;
+	}
+	if (ep->recv_state == RECV_PDU)
+		ret = tcp_read_msg(ep);
+	if (!ret && ep->recv_state == HANDLE_PDU)
+		ret = tcp_handle_msg(ep);
+	/* Payload reception resumes here until all data is in */
+	if (!ret && ep->recv_state == RECV_DATA)
+		ret = tcp_recv_data(ep);
+	if (ret >= 0 && ep->recv_state == HANDLE_PDU)
+		ep->recv_state = RECV_PDU;
+	return ret;
 }
 
-int run_endpoint(struct endpoint *ep, int id)
+/*
+ * Handle all complete PDUs in the receive buffer; a partial PDU is
+ * left in the buffer until more data arrives.
+ * Returns a negative error if the endpoint should be disconnected.
+ */
+int endpoint_handle_data(struct endpoint *ep)
 {
 	int ret;
 
-	ret = tcp_create_endpoint(ep, id);
-	if (ret) {
-		fprintf(stderr, "ep %d: create failed error %d\n",
-			id, ret);
-		return ret;
+	do {
+		ret = endpoint_handle_pdu(ep);
+	} while (!ret && ep->rx_tail > ep->rx_head);
+
+	/*
+	 * Send the responses for all PDUs handled above in one go;
+	 * io_uring endpoints are flushed by the reactor.
+	 */
+	if (!ep->reactor->uring) {
+		int err = tcp_send_flush(ep);
+
+		if (!ret || ret == -EAGAIN)
+			ret = err;
 	}
+	return endpoint_check_error(ep, ret);
+}
 
-retry:
-	ret = tcp_accept_connection(ep);
-	if (ret) {
-		if (ret == -EAGAIN)
-			goto retry;
+/*
+ * Called from the reactor whenever the endpoint socket becomes readable.
+ * Returns a negative error if the endpoint should be disconnected.
+ */
+int endpoint_handle_event(struct endpoint *ep)
+{
+	int ret;
 
-		ep_err(ep, "accept failed error %d", ret);
-		return ret;
+	/* A TLS handshake can only be the first thing on the connection */
+	if (ep->recv_state == RECV_ICREQ && ep->iface->tls_key &&
+	    !ep->tls_session && ep->rx_tail == ep->rx_head) {
+		ret = tls_accept(ep);
+		if (ret < 0)
+			return endpoint_check_error(ep, ret);
+		if (ret > 0)
+			ep->recv_state = RECV_TLS;
+	}
+	if (ep->recv_state == RECV_TLS) {
+		ret = tls_handshake(ep);
+		if (ret < 0)
+			return endpoint_check_error(ep, ret);
+		ep->recv_state = RECV_ICREQ;
 	}
 
-	return 0;
+	do {
+		ret = tcp_rx_fill(ep);
+		if (ret < 0 && ret != -EAGAIN)
+			return endpoint_check_error(ep, ret);
+		ret = endpoint_handle_data(ep);
+	} while (!ret && tls_pending(ep));
+	return ret;
 }
 
 struct endpoint *enqueue_endpoint(int id, struct interface *iface)
@@ -171,24 +157,42 @@ struct endpoint *enqueue_endpoint(int id, struct interface *iface)
 
 	memset(ep, 0, sizeof(struct endpoint));
 
+	/* Holds a handshake slot until connected or released */
+	ep->handshake = true;
 	ep->iface = iface;
 	ep->kato_countdown = ep->iface->ctx->ttl;
 	ep->kato_interval = KATO_INTERVAL;
-	ep->maxh2cdata = 0x10000;
+	/*
+	 * The ICResp always advertised 0xf000, so keep that by default,
+	 * and split C2H data the same way
+	 */
+	ep->maxh2cdata = iface->ctx->maxdata ? iface->ctx->maxdata : 0xf000;
+	ep->maxc2hdata = ep->maxh2cdata;
+	ep->mdts = iface->ctx->mdts;
 	ep->qid = -1;
-	ep->recv_state = RECV_PDU;
+	ep->recv_state = RECV_ICREQ;
+	INIT_LIST_HEAD(&ep->reactor_node);
 
-	ret = run_endpoint(ep, id);
+	ret = tcp_create_endpoint(ep, id);
 	if (ret) {
-		ep_err(ep, "run_endpoint failed error %d", ret);
+		fprintf(stderr, "ep %d: create failed error %d\n",
+			id, ret);
 		goto out;
 	}
 
 	pthread_mutex_lock(&iface->ep_mutex);
 	list_add(&ep->node, &iface->ep_list);
 	pthread_mutex_unlock(&iface->ep_mutex);
+
+	ret = reactor_add_endpoint(ep);
+	if (ret) {
+		ep_err(ep, "no reactor available, error %d", ret);
+		dequeue_endpoint(ep);
+		return NULL;
+	}
 	return ep;
 out:
+	interface_handshake_done(ep);
 	free(ep);
 	close(id);
 	return NULL;
@@ -196,9 +200,31 @@ out:
 
 void dequeue_endpoint(struct endpoint *ep)
 {
-	if (ep->pthread) {
-		pthread_join(ep->pthread, NULL);
-	}
-	list_del(&ep->node);
+	struct interface *iface = ep->iface;
+
+	pthread_mutex_lock(&iface->ep_mutex);
+	list_del_init(&ep->node);
+	pthread_cond_signal(&iface->ep_cond);
+	pthread_mutex_unlock(&iface->ep_mutex);
+
+	interface_handshake_done(ep);
+	handle_disconnect(ep, !stopped);
+	ep_info(ep, "%s", stopped ? "stopped" : "disconnected");
 	free(ep);
 }
+
+/*
+ * Shutdown all endpoints of an interface and wait for the
+ * reactors to release them.
+ */
+void drain_endpoints(struct interface *iface)
+{
+	struct endpoint *ep;
+
+	pthread_mutex_lock(&iface->ep_mutex);
+	list_for_each_entry(ep, &iface->ep_list, node)
+		shutdown(ep->sockfd, SHUT_RDWR);
+	while (!list_empty(&iface->ep_list))
+		pthread_cond_wait(&iface->ep_cond, &iface->ep_mutex);
+	pthread_mutex_unlock(&iface->ep_mutex);
+}
@@ -1,9 +1,11 @@
 #ifndef _NVMET_ENDPOINT_H
 #define _NVMET_ENDPOINT_H
 
-void *endpoint_thread(void *arg);
+int endpoint_handle_data(struct endpoint *ep);
+int endpoint_handle_event(struct endpoint *ep);
 struct endpoint *enqueue_endpoint(int id, struct interface *iface);
 void dequeue_endpoint(struct endpoint *ep);
+void drain_endpoints(struct interface *iface);
 
 #endif /* _NVMET_ENDPOINT_H */
 
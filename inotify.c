@@ -1069,6 +1069,7 @@ void *inotify_loop(void *arg)
 		goto out_cleanup;
 	if (watch_ports_dir(inotify_fd, ctx) < 0)
 		goto out_cleanup;
+	discdb_publish();
 
 	while (!stopped) {
 		int rlen, ret;
@@ -1108,6 +1109,7 @@ void *inotify_loop(void *arg)
 			}
 			iev_buf += iev_len;
 		}
+		discdb_publish();
 	}
 out_cleanup:
 	cleanup_watcher(inotify_fd, ctx);
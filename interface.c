@@ -1,83 +1,325 @@
 #include <stdio.h>
+#include <stdbool.h>
+#include <poll.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <netdb.h>
 
 #include "common.h"
+#include "affinity.h"
 #include "tcp.h"
 #include "endpoint.h"
 #include "discdb.h"
 
+#define IFACE_MAX_EVENTS	16
+#define IFACE_ACCEPT_BATCH	8
+
 LIST_HEAD(interface_list);
 pthread_mutex_t interface_lock = PTHREAD_MUTEX_INITIALIZER;
 
-static void *interface_thread(void *arg)
+/*
+ * A single acceptor thread serves the listeners of all interfaces.
+ * Each interface contributes its own epoll set of listening sockets,
+ * which is nested into the acceptor epoll set.
+ */
+static pthread_t acceptor_pthread;
+static int acceptor_epollfd = -1;
+static int acceptor_eventfd = -1;
+static bool acceptor_running;
+static unsigned int acceptor_gen;
+static pthread_mutex_t acceptor_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t acceptor_cond = PTHREAD_COND_INITIALIZER;
+
+/*
+ * Admission control: at most admission_max endpoints may be between
+ * accept and a successful connect. Further connections are left in
+ * the listen backlogs, and the acceptor is woken up once a slot is
+ * released again. Only the acceptor takes slots, so checking the
+ * count before taking one cannot overshoot the limit.
+ */
+struct admission_stats admission_stats;
+static int admission_max;
+
+static void acceptor_wakeup(void)
 {
-	struct interface *iface = arg;
-	struct endpoint *ep, *_ep;
-	int id;
-	pthread_attr_t pthread_attr;
-	int ret;
+	u64 val = 1;
 
-	ret = tcp_init_listener(iface);
-	if (ret < 0) {
-		fprintf(stderr,
-			"iface %d: listener start error %d\n",
-			iface->portid, ret);
-		pthread_exit(NULL);
-		return NULL;
-	}
+	if (write(acceptor_eventfd, &val, sizeof(val)) < 0)
+		fprintf(stderr, "acceptor: wakeup failed, error %d\n", errno);
+}
 
-	while (!stopped) {
-		id = tcp_wait_for_connection(iface, KATO_INTERVAL);
+static bool interface_admission_full(void)
+{
+	return admission_max &&
+		__atomic_load_n(&admission_stats.handshakes,
+				__ATOMIC_SEQ_CST) >= admission_max;
+}
 
-		if (stopped)
-			break;
+static void interface_admit(void)
+{
+	int n;
+
+	n = __atomic_add_fetch(&admission_stats.handshakes, 1,
+			       __ATOMIC_SEQ_CST);
+	/*
+	 * Only the acceptor raises the peak, so it is exact; the store
+	 * is atomic for interface_show_stats().
+	 */
+	if (n > admission_stats.handshakes_peak)
+		__atomic_store_n(&admission_stats.handshakes_peak, n,
+				 __ATOMIC_RELAXED);
+	__atomic_add_fetch(&admission_stats.accepted, 1, __ATOMIC_RELAXED);
+}
 
-		if (id < 0) {
-			if (id == -EAGAIN) {
+/*
+ * Release the handshake slot of @ep once it is connected or gone.
+ */
+void interface_handshake_done(struct endpoint *ep)
+{
+	int n;
+
+	if (!ep->handshake)
+		return;
+	ep->handshake = false;
+	n = __atomic_sub_fetch(&admission_stats.handshakes, 1,
+			       __ATOMIC_SEQ_CST);
+	if (admission_max && n == admission_max - 1)
+		acceptor_wakeup();
+}
+
+void interface_show_stats(void)
+{
+	printf("admission: %lu accepted, %d handshakes (peak %d, limit %d), "
+	       "%lu deferred, %lu host rejects\n",
+	       __atomic_load_n(&admission_stats.accepted, __ATOMIC_RELAXED),
+	       __atomic_load_n(&admission_stats.handshakes, __ATOMIC_RELAXED),
+	       __atomic_load_n(&admission_stats.handshakes_peak,
+			       __ATOMIC_RELAXED), admission_max,
+	       __atomic_load_n(&admission_stats.deferred, __ATOMIC_RELAXED),
+	       __atomic_load_n(&admission_stats.host_rejected,
+			       __ATOMIC_RELAXED));
+}
+
+static void interface_accept(struct interface *iface)
+{
+	struct endpoint *ep;
+	int fds[IFACE_MAX_EVENTS];
+	int i, j, n, id;
+
+	n = tcp_wait_for_connection(iface, fds, IFACE_MAX_EVENTS, 0);
+	if (n < 0) {
+		if (n != -ETIMEDOUT && n != -EAGAIN)
+			fprintf(stderr, "iface %d: listener error %d\n",
+				iface->portid, n);
+		return;
+	}
+	/*
+	 * Take a batch from each ready listener in turn, the reactors take
+	 * it from here. Whatever is left is picked up on the next round as
+	 * the listeners are level triggered.
+	 */
+	for (i = 0; i < n; i++) {
+		for (j = 0; j < IFACE_ACCEPT_BATCH; j++) {
+			if (interface_admission_full())
+				return;
+			id = tcp_accept(iface, fds[i]);
+			if (id < 0)
+				break;
+			interface_admit();
+			ep = enqueue_endpoint(id, iface);
+			if (!ep)
 				fprintf(stderr,
-					"iface %d: listener interrupted\n",
+					"iface %d: endpoint start error\n",
 					iface->portid);
+		}
+	}
+}
+
+/*
+ * Wait for the eventfd only while the handshake budget is exhausted.
+ */
+static int acceptor_pause(struct epoll_event *events)
+{
+	struct pollfd pfd = {
+		.fd = acceptor_eventfd,
+		.events = POLLIN,
+	};
+	int ret;
+
+	__atomic_add_fetch(&admission_stats.deferred, 1, __ATOMIC_RELAXED);
+	ret = poll(&pfd, 1, -1);
+	if (ret <= 0)
+		return ret;
+	events[0].events = EPOLLIN;
+	events[0].data.ptr = NULL;
+	return 1;
+}
+
+static void *acceptor_thread(void *arg)
+{
+	struct epoll_event events[IFACE_MAX_EVENTS];
+	struct interface *iface;
+	int i, n;
+
+	while (!stopped && acceptor_running) {
+		if (interface_admission_full())
+			n = acceptor_pause(events);
+		else
+			n = epoll_wait(acceptor_epollfd, events,
+				       IFACE_MAX_EVENTS, -1);
+		if (n < 0) {
+			if (errno == EINTR)
 				continue;
-			}
-			fprintf(stderr,
-				"iface %d: listener error %d\n",
-				iface->portid, id);
+			fprintf(stderr, "acceptor: epoll error %d\n", errno);
 			break;
 		}
-		ep = enqueue_endpoint(id, iface);
-		if (!ep)
-			continue;
+		pthread_mutex_lock(&acceptor_lock);
+		for (i = 0; i < n; i++) {
+			iface = events[i].data.ptr;
+			if (!iface) {
+				u64 val;
 
-		pthread_attr_init(&pthread_attr);
-
-		ret = pthread_create(&ep->pthread, &pthread_attr,
-				     endpoint_thread, ep);
-		if (ret) {
-			ep->pthread = 0;
-			fprintf(stderr,
-				"iface %d: endpoint start error %d\n",
-				iface->portid, ret);
+				if (read(acceptor_eventfd, &val,
+					 sizeof(val)) < 0 && errno != EAGAIN)
+					fprintf(stderr,
+						"acceptor: eventfd error %d\n",
+						errno);
+				continue;
+			}
+			interface_accept(iface);
 		}
-		pthread_attr_destroy(&pthread_attr);
+		/* Tell interface_delete() that no stale events are left */
+		acceptor_gen++;
+		pthread_cond_broadcast(&acceptor_cond);
+		pthread_mutex_unlock(&acceptor_lock);
 	}
 
-	printf("iface %d: destroy listener\n", iface->portid);
-
-	tcp_destroy_listener(iface);
-	pthread_mutex_lock(&iface->ep_mutex);
-	list_for_each_entry_safe(ep, _ep, &iface->ep_list, node)
-		dequeue_endpoint(ep);
-	pthread_mutex_unlock(&iface->ep_mutex);
+	pthread_mutex_lock(&acceptor_lock);
+	acceptor_running = false;
+	pthread_cond_broadcast(&acceptor_cond);
+	pthread_mutex_unlock(&acceptor_lock);
 	pthread_exit(NULL);
 	return NULL;
 }
 
+static int acceptor_add(struct interface *iface)
+{
+	struct epoll_event ev;
+
+	ev.events = EPOLLIN;
+	ev.data.ptr = iface;
+	if (epoll_ctl(acceptor_epollfd, EPOLL_CTL_ADD,
+		      iface->epollfd, &ev) < 0) {
+		fprintf(stderr, "iface %d: failed to add listener, error %d\n",
+			iface->portid, errno);
+		return -errno;
+	}
+	return 0;
+}
+
+/*
+ * Remove the interface from the acceptor and wait for the acceptor
+ * to finish any event batch which might still reference it.
+ */
+static void acceptor_del(struct interface *iface)
+{
+	unsigned int gen;
+
+	if (acceptor_epollfd < 0 || iface->epollfd < 0)
+		return;
+	pthread_mutex_lock(&acceptor_lock);
+	if (epoll_ctl(acceptor_epollfd, EPOLL_CTL_DEL,
+		      iface->epollfd, NULL) < 0)
+		fprintf(stderr, "iface %d: failed to remove listener, error %d\n",
+			iface->portid, errno);
+	gen = acceptor_gen;
+	if (acceptor_running)
+		acceptor_wakeup();
+	while (acceptor_running && acceptor_gen == gen)
+		pthread_cond_wait(&acceptor_cond, &acceptor_lock);
+	pthread_mutex_unlock(&acceptor_lock);
+}
+
+int interface_init(struct etcd_cdc_ctx *ctx)
+{
+	struct epoll_event ev;
+	int ret;
+
+	admission_max = ctx->max_handshakes;
+	acceptor_eventfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	acceptor_epollfd = epoll_create1(EPOLL_CLOEXEC);
+	if (acceptor_eventfd < 0 || acceptor_epollfd < 0) {
+		fprintf(stderr, "acceptor: setup failed, error %d\n", errno);
+		ret = -errno;
+		goto out_close;
+	}
+	ev.events = EPOLLIN;
+	ev.data.ptr = NULL;
+	if (epoll_ctl(acceptor_epollfd, EPOLL_CTL_ADD,
+		      acceptor_eventfd, &ev) < 0) {
+		fprintf(stderr, "acceptor: failed to add eventfd, error %d\n",
+			errno);
+		ret = -errno;
+		goto out_close;
+	}
+	acceptor_running = true;
+	ret = pthread_create(&acceptor_pthread, NULL, acceptor_thread, NULL);
+	if (ret) {
+		fprintf(stderr, "acceptor: failed to start, error %d\n", ret);
+		acceptor_running = false;
+		ret = -ret;
+		goto out_close;
+	}
+	affinity_pin(acceptor_pthread, ctx->cpus, ctx->nr_cpus);
+	return 0;
+
+out_close:
+	if (acceptor_epollfd >= 0)
+		close(acceptor_epollfd);
+	acceptor_epollfd = -1;
+	if (acceptor_eventfd >= 0)
+		close(acceptor_eventfd);
+	acceptor_eventfd = -1;
+	return ret;
+}
+
+static struct interface *interface_alloc(struct etcd_cdc_ctx *ctx)
+{
+	struct interface *iface;
+
+	iface = malloc(sizeof(struct interface));
+	if (!iface)
+		return NULL;
+	memset(iface, 0, sizeof(struct interface));
+	INIT_LIST_HEAD(&iface->node);
+	INIT_LIST_HEAD(&iface->ep_list);
+	pthread_mutex_init(&iface->ep_mutex, NULL);
+	pthread_cond_init(&iface->ep_cond, NULL);
+	iface->epollfd = -1;
+	iface->numa_node = -1;
+	iface->ctx = ctx;
+	if (ctx->tls_key) {
+		/* Plaintext connections are still accepted */
+		iface->tls_key = ctx->tls_key;
+		iface->tls_key_len = ctx->tls_key_len;
+		strcpy(iface->port.treq, "not required");
+		strcpy(iface->port.tsas, "tls13");
+	}
+	return iface;
+}
+
+static void interface_release(struct interface *iface)
+{
+	pthread_cond_destroy(&iface->ep_cond);
+	pthread_mutex_destroy(&iface->ep_mutex);
+	free(iface);
+}
+
 int interface_create(struct etcd_cdc_ctx *ctx, struct nvmet_port *port)
 {
 	struct interface *iface;
-	pthread_attr_t pthread_attr;
 	int ret = 0;
 
 	if (strcmp(port->trtype, "tcp")) {
@@ -101,17 +343,11 @@ int interface_create(struct etcd_cdc_ctx *ctx, struct nvmet_port *port)
 		goto out_unlock;
 	}
 
-	iface = malloc(sizeof(struct interface));
+	iface = interface_alloc(ctx);
 	if (!iface) {
 		ret = -ENOMEM;
 		goto out_unlock;
 	}
-	memset(iface, 0, sizeof(struct interface));
-	INIT_LIST_HEAD(&iface->node);
-	INIT_LIST_HEAD(&iface->ep_list);
-	pthread_mutex_init(&iface->ep_mutex, NULL);
-	iface->listenfd = -1;
-	iface->ctx = ctx;
 	strcpy(iface->port.trtype, port->trtype);
 	strcpy(iface->port.traddr, port->traddr);
 	strcpy(iface->port.adrfam, port->adrfam);
@@ -120,34 +356,43 @@ int interface_create(struct etcd_cdc_ctx *ctx, struct nvmet_port *port)
 		iface->adrfam = AF_INET6;
 	else
 		iface->adrfam = AF_INET;
-	pthread_mutex_init(&iface->ep_mutex, NULL);
+	if (ctx->numa)
+		iface->numa_node = affinity_addr_node(port->traddr,
+						      iface->adrfam);
 	ret = discdb_add_port(&iface->port, NVME_NQN_CURR);
 	if (ret < 0) {
 		fprintf(stderr, "failed to create interface for %s:%s:%s\n",
 			iface->port.trtype, iface->port.traddr,
 			iface->port.trsvcid);
-		free(iface);
+		interface_release(iface);
 		iface = NULL;
 		goto out_unlock;
 	}
 	iface->portid = iface->port.port_id;
 	printf("iface %d: created %s addr %s:%s\n", iface->portid,
 	       iface->port.adrfam, iface->port.traddr, iface->port.trsvcid);
-	list_add(&iface->node, &interface_list);
+	if (iface->numa_node >= 0)
+		printf("iface %d: using numa node %d\n", iface->portid,
+		       iface->numa_node);
 
-	pthread_attr_init(&pthread_attr);
-	ret = pthread_create(&iface->pthread, &pthread_attr,
-			     interface_thread, iface);
-	pthread_attr_destroy(&pthread_attr);
-	if (ret) {
-		iface->pthread = 0;
-		fprintf(stderr, "iface %d: failed to start iface, error %d\n",
+	ret = tcp_init_listener(iface);
+	if (ret < 0) {
+		fprintf(stderr, "iface %d: listener start error %d\n",
 			iface->portid, ret);
-		list_del_init(&iface->node);
-		discdb_del_port(&iface->port);
-		free(iface);
-		iface = NULL;
+		goto out_del_port;
+	}
+	ret = acceptor_add(iface);
+	if (ret < 0) {
+		tcp_destroy_listener(iface);
+		goto out_del_port;
 	}
+	list_add(&iface->node, &interface_list);
+	goto out_unlock;
+
+out_del_port:
+	discdb_del_port(&iface->port);
+	interface_release(iface);
+	iface = NULL;
 out_unlock:
 	pthread_mutex_unlock(&interface_lock);
 	if (iface)
@@ -155,12 +400,53 @@ out_unlock:
 	return ret;
 }
 
+/*
+ * Local listener on the AF_UNIX socket @path for co-located initiators,
+ * speaking the same NVMe/TCP PDU framing. It is not backed by a
+ * configfs port and therefore not part of the discovery log page.
+ */
+int interface_create_unix(struct etcd_cdc_ctx *ctx, const char *path)
+{
+	struct interface *iface;
+	int ret;
+
+	iface = interface_alloc(ctx);
+	if (!iface)
+		return -ENOMEM;
+	strcpy(iface->port.trtype, "tcp");
+	strcpy(iface->port.adrfam, "unix");
+	strncpy(iface->port.traddr, path, sizeof(iface->port.traddr) - 1);
+	iface->adrfam = AF_UNIX;
+
+	ret = tcp_init_listener(iface);
+	if (ret < 0) {
+		fprintf(stderr, "iface %d: listener start error %d\n",
+			iface->portid, ret);
+		interface_release(iface);
+		return ret;
+	}
+	ret = acceptor_add(iface);
+	if (ret < 0) {
+		tcp_destroy_listener(iface);
+		interface_release(iface);
+		return ret;
+	}
+	pthread_mutex_lock(&interface_lock);
+	list_add(&iface->node, &interface_list);
+	pthread_mutex_unlock(&interface_lock);
+	printf("iface %d: created unix addr %s\n", iface->portid, path);
+	return 0;
+}
+
 static void interface_free(struct interface *iface)
 {
 	printf("%s: free interface %d\n", __func__, iface->portid);
 
-	if (iface->pthread)
-		pthread_join(iface->pthread, NULL);
+	acceptor_del(iface);
+	printf("iface %d: destroy listener\n", iface->portid);
+	tcp_destroy_listener(iface);
+	drain_endpoints(iface);
+	pthread_cond_destroy(&iface->ep_cond);
 	pthread_mutex_destroy(&iface->ep_mutex);
 	list_del_init(&iface->node);
 	discdb_del_port(&iface->port);
@@ -171,11 +457,28 @@ void interface_stop(void)
 {
 	struct interface *iface;
 
+	if (acceptor_epollfd < 0)
+		return;
+
+	pthread_mutex_lock(&acceptor_lock);
+	acceptor_running = false;
+	acceptor_wakeup();
+	pthread_mutex_unlock(&acceptor_lock);
+	pthread_join(acceptor_pthread, NULL);
+
+	pthread_mutex_lock(&interface_lock);
 	list_for_each_entry(iface, &interface_list, node) {
 		fprintf(stderr, "iface %d: terminating\n",
 			iface->portid);
-		pthread_kill(iface->pthread, SIGTERM);
+		tcp_destroy_listener(iface);
+		drain_endpoints(iface);
 	}
+	pthread_mutex_unlock(&interface_lock);
+
+	close(acceptor_epollfd);
+	acceptor_epollfd = -1;
+	close(acceptor_eventfd);
+	acceptor_eventfd = -1;
 }
 
 void interface_delete(struct etcd_cdc_ctx *ctx, struct nvmet_port *port)
@@ -0,0 +1,150 @@
+/*
+ * logcache.c
+ * Cache of discovery log pages across topology snapshots.
+ *
+ * Each snapshot holds the log page of every host, but most changes
+ * of the configuration only affect a few hosts. So when a snapshot is
+ * built the page of a host is carried over from the previous one,
+ * unless discdb has invalidated it since.
+ *
+ * discdb invalidates every host whose generation counter it bumps,
+ * and the hosts affected by changes which do not bump the counter.
+ * A page is only reused if it carries the counter the host has now.
+ * The entries of the discovery NQN are merged into the log page of
+ * every host, so invalidating that NQN drops the entire cache.
+ *
+ * Invalidations are collected for a batch of changes and consumed
+ * when the snapshot for that batch has been built; both happen on the
+ * thread modifying the database, so only the statistics are shared.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "common.h"
+#include "logcache.h"
+#include "topology.h"
+
+static char **invalidate_nqns;
+static int nr_invalidate, max_invalidate;
+static bool invalidate_all;
+
+static struct {
+	unsigned long hits;
+	unsigned long misses;
+	unsigned long invalidations;
+} logcache_stats;
+
+static void logcache_count(unsigned long *counter)
+{
+	__atomic_add_fetch(counter, 1, __ATOMIC_RELAXED);
+}
+
+static bool logcache_invalid(const char *hostnqn)
+{
+	int i;
+
+	if (invalidate_all)
+		return true;
+	for (i = 0; i < nr_invalidate; i++) {
+		if (!strcasecmp(invalidate_nqns[i], hostnqn))
+			return true;
+	}
+	return false;
+}
+
+void logcache_invalidate(const char *hostnqn)
+{
+	char **nqns;
+
+	if (!strcasecmp(hostnqn, NVME_DISC_SUBSYS_NAME)) {
+		logcache_invalidate_all();
+		return;
+	}
+	if (logcache_invalid(hostnqn))
+		return;
+	logcache_count(&logcache_stats.invalidations);
+	if (nr_invalidate == max_invalidate) {
+		nqns = realloc(invalidate_nqns,
+			       (max_invalidate + 16) * sizeof(char *));
+		if (!nqns) {
+			invalidate_all = true;
+			return;
+		}
+		invalidate_nqns = nqns;
+		max_invalidate += 16;
+	}
+	invalidate_nqns[nr_invalidate] = strdup(hostnqn);
+	if (!invalidate_nqns[nr_invalidate]) {
+		invalidate_all = true;
+		return;
+	}
+	nr_invalidate++;
+}
+
+void logcache_invalidate_all(void)
+{
+	if (!invalidate_all)
+		logcache_count(&logcache_stats.invalidations);
+	invalidate_all = true;
+}
+
+/*
+ * Log page of @hostnqn in @old with a reference taken, if it is still
+ * valid for a host with generation counter @genctr. Returns NULL if
+ * the page has to be built.
+ */
+struct topo_host *logcache_get(struct topo_snapshot *old,
+			       const char *hostnqn, u64 genctr)
+{
+	struct topo_host *host;
+
+	/* Built first, as the entries are merged into every page */
+	if (!strcasecmp(hostnqn, NVME_DISC_SUBSYS_NAME))
+		return NULL;
+	host = topology_find_host(old, hostnqn);
+	if (!host || logcache_invalid(hostnqn) ||
+	    le64toh(host->hdr->genctr) != genctr) {
+		logcache_count(&logcache_stats.misses);
+		return NULL;
+	}
+	logcache_count(&logcache_stats.hits);
+	topology_get_host(host);
+	return host;
+}
+
+/*
+ * Drop the invalidations once a snapshot reflecting them has been
+ * built.
+ */
+void logcache_reset(void)
+{
+	int i;
+
+	for (i = 0; i < nr_invalidate; i++)
+		free(invalidate_nqns[i]);
+	nr_invalidate = 0;
+	invalidate_all = false;
+}
+
+void logcache_exit(void)
+{
+	logcache_reset();
+	free(invalidate_nqns);
+	invalidate_nqns = NULL;
+	max_invalidate = 0;
+}
+
+void logcache_show_stats(void)
+{
+	unsigned long hits, misses;
+
+	hits = __atomic_load_n(&logcache_stats.hits, __ATOMIC_RELAXED);
+	misses = __atomic_load_n(&logcache_stats.misses, __ATOMIC_RELAXED);
+	printf("logcache: %lu pages reused, %lu built, %lu%% hit rate, "
+	       "%lu invalidations\n", hits, misses,
+	       hits + misses ? hits * 100 / (hits + misses) : 0,
+	       __atomic_load_n(&logcache_stats.invalidations,
+			       __ATOMIC_RELAXED));
+}
@@ -0,0 +1,15 @@
+#ifndef _NVMET_LOGCACHE_H
+#define _NVMET_LOGCACHE_H
+
+struct topo_host;
+struct topo_snapshot;
+
+void logcache_invalidate(const char *hostnqn);
+void logcache_invalidate_all(void);
+struct topo_host *logcache_get(struct topo_snapshot *old,
+			       const char *hostnqn, u64 genctr);
+void logcache_reset(void);
+void logcache_exit(void);
+void logcache_show_stats(void);
+
+#endif /* _NVMET_LOGCACHE_H */
@@ -0,0 +1,87 @@
+/*
+ * pool.c
+ * Size-classed payload buffer pool
+ *
+ * Each reactor keeps its own pool, so buffers are allocated and
+ * returned from a single thread only and no locking is required.
+ */
+#include <stdio.h>
+
+#include "common.h"
+#include "pool.h"
+
+struct pool_buf {
+	struct pool_buf *next;
+};
+
+static int pool_class(size_t len)
+{
+	int cls = 0;
+	size_t size = POOL_MIN_SIZE;
+
+	while (size < len) {
+		size <<= 1;
+		cls++;
+	}
+	return cls;
+}
+
+void pool_init(struct buf_pool *pool, size_t max_cached)
+{
+	memset(pool, 0, sizeof(*pool));
+	pool->max_cached = max_cached;
+}
+
+void pool_exit(struct buf_pool *pool)
+{
+	struct pool_buf *buf;
+	int cls;
+
+	for (cls = 0; cls < POOL_NR_CLASSES; cls++) {
+		while ((buf = pool->free_list[cls])) {
+			pool->free_list[cls] = buf->next;
+			free(buf);
+		}
+	}
+	pool->cached = 0;
+}
+
+/*
+ * Allocate a buffer of at least @len bytes. The buffer contents are
+ * undefined; callers have to initialize what they do not overwrite.
+ */
+void *pool_alloc(struct buf_pool *pool, size_t len)
+{
+	struct pool_buf *buf;
+	int cls = pool_class(len);
+
+	if (cls >= POOL_NR_CLASSES)
+		return malloc(len);
+	buf = pool->free_list[cls];
+	if (buf) {
+		pool->free_list[cls] = buf->next;
+		pool->cached -= POOL_MIN_SIZE << cls;
+		return buf;
+	}
+	return malloc(POOL_MIN_SIZE << cls);
+}
+
+/*
+ * Return a buffer of @len bytes to the pool, or to the system once
+ * the pool holds more than its high-water mark.
+ */
+void pool_free(struct buf_pool *pool, void *ptr, size_t len)
+{
+	struct pool_buf *buf = ptr;
+	int cls = pool_class(len);
+	size_t size = POOL_MIN_SIZE << cls;
+
+	if (cls >= POOL_NR_CLASSES ||
+	    pool->cached + size > pool->max_cached) {
+		free(ptr);
+		return;
+	}
+	buf->next = pool->free_list[cls];
+	pool->free_list[cls] = buf;
+	pool->cached += size;
+}
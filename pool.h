@@ -0,0 +1,9 @@
+#ifndef _NVMET_POOL_H
+#define _NVMET_POOL_H
+
+void pool_init(struct buf_pool *pool, size_t max_cached);
+void pool_exit(struct buf_pool *pool);
+void *pool_alloc(struct buf_pool *pool, size_t len);
+void pool_free(struct buf_pool *pool, void *ptr, size_t len);
+
+#endif /* _NVMET_POOL_H */
@@ -0,0 +1,546 @@
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+
+#include "common.h"
+#include "affinity.h"
+#include "endpoint.h"
+#include "reactor.h"
+#include "pool.h"
+#include "tcp.h"
+#include "uring.h"
+
+#define REACTOR_MAX_EVENTS	64
+#define REACTOR_BUSY_POLL_BUDGET	8
+
+#ifndef EPIOCSPARAMS
+/* Linux 6.9+, missing from older uapi headers */
+struct epoll_params {
+	__u32 busy_poll_usecs;
+	__u16 busy_poll_budget;
+	__u8 prefer_busy_poll;
+	__u8 __pad;
+};
+
+#define EPIOCSPARAMS	_IOW(0x8A, 0x01, struct epoll_params)
+#endif
+
+static struct reactor *reactors;
+static int nr_reactors;
+static unsigned int reactor_next;
+
+static u64 reactor_now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (u64)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static u64 reactor_now_ms(void)
+{
+	return reactor_now_us() / 1000;
+}
+
+static void reactor_wakeup(struct reactor *r)
+{
+	u64 val = 1;
+
+	if (write(r->eventfd, &val, sizeof(val)) < 0)
+		fprintf(stderr, "reactor %d: wakeup failed, error %d\n",
+			r->id, errno);
+}
+
+/*
+ * Final teardown once the transport engine holds no more references
+ * to the endpoint. Commands still executing on a worker keep the
+ * endpoint around until their completion has been picked up.
+ */
+void reactor_release_endpoint(struct reactor *r, struct endpoint *ep)
+{
+	if (ep->nr_work) {
+		ep->release_pending = true;
+		return;
+	}
+	list_del_init(&ep->reactor_node);
+	r->nr_endpoints--;
+	dequeue_endpoint(ep);
+}
+
+void reactor_del_endpoint(struct reactor *r, struct endpoint *ep)
+{
+	if (ep->closing)
+		return;
+	ep->closing = true;
+	/* Parked AERs pin the endpoint like commands on a worker */
+	handle_aer_abort(ep);
+	if (r->uring) {
+		/* Released from the completion of the outstanding requests */
+		uring_del_endpoint(r, ep);
+		return;
+	}
+	if (epoll_ctl(r->epollfd, EPOLL_CTL_DEL, ep->sockfd, NULL) < 0)
+		fprintf(stderr, "reactor %d: failed to remove fd %d, error %d\n",
+			r->id, ep->sockfd, errno);
+	reactor_release_endpoint(r, ep);
+}
+
+/*
+ * Wait for EPOLLOUT only while the endpoint has a send backlog.
+ */
+static int reactor_update_events(struct reactor *r, struct endpoint *ep)
+{
+	bool pollout = !list_empty(&ep->send_list);
+	struct epoll_event ev;
+
+	if (pollout == ep->pollout)
+		return 0;
+	ev.events = pollout ? EPOLLIN | EPOLLOUT : EPOLLIN;
+	ev.data.ptr = ep;
+	if (epoll_ctl(r->epollfd, EPOLL_CTL_MOD, ep->sockfd, &ev) < 0) {
+		fprintf(stderr, "reactor %d: failed to modify fd %d, error %d\n",
+			r->id, ep->sockfd, errno);
+		return -errno;
+	}
+	ep->pollout = pollout;
+	return 0;
+}
+
+void reactor_add_pending(struct reactor *r)
+{
+	struct endpoint *ep, *_ep;
+	struct epoll_event ev;
+	LIST_HEAD(pending);
+	int ret;
+
+	pthread_mutex_lock(&r->lock);
+	list_splice_init(&r->pending, &pending);
+	pthread_mutex_unlock(&r->lock);
+
+	list_for_each_entry_safe(ep, _ep, &pending, reactor_node) {
+		list_del_init(&ep->reactor_node);
+		ret = tcp_alloc_buffers(ep);
+		if (ret < 0) {
+			dequeue_endpoint(ep);
+			continue;
+		}
+		if (r->uring)
+			ret = uring_add_endpoint(r, ep);
+		else {
+			ev.events = EPOLLIN;
+			ev.data.ptr = ep;
+			ret = epoll_ctl(r->epollfd, EPOLL_CTL_ADD,
+					ep->sockfd, &ev);
+			if (ret < 0)
+				ret = -errno;
+		}
+		if (ret < 0) {
+			fprintf(stderr,
+				"reactor %d: failed to add fd %d, error %d\n",
+				r->id, ep->sockfd, -ret);
+			dequeue_endpoint(ep);
+			continue;
+		}
+		list_add_tail(&ep->reactor_node, &r->ep_list);
+		r->nr_endpoints++;
+		/*
+		 * With TCP_DEFER_ACCEPT the ICReq is usually queued already,
+		 * so do not wait for epoll to report it.
+		 */
+		if (!r->uring && ep->iface->ctx->defer_accept) {
+			ret = endpoint_handle_event(ep);
+			if (!ret)
+				ret = reactor_update_events(r, ep);
+			if (ret < 0)
+				reactor_del_endpoint(r, ep);
+		}
+	}
+}
+
+static void reactor_kato_tick(struct reactor *r)
+{
+	struct endpoint *ep, *_ep;
+
+	list_for_each_entry_safe(ep, _ep, &r->ep_list, reactor_node) {
+		if (ep->closing)
+			continue;
+		/* Do not count the interval if there was activity */
+		if (ep->kato_reset) {
+			ep->kato_reset = false;
+			continue;
+		}
+		if (--ep->kato_countdown)
+			continue;
+		fprintf(stderr, "ep %d: KATO timeout\n", ep->sockfd);
+		reactor_del_endpoint(r, ep);
+	}
+}
+
+/*
+ * Called from a worker thread once a deferred command has finished;
+ * the reactor owning the endpoint sends the completion.
+ */
+void reactor_complete_work(struct ep_qe *qe)
+{
+	struct reactor *r = qe->ep->reactor;
+
+	pthread_mutex_lock(&r->lock);
+	list_add_tail(&qe->work_node, &r->done);
+	pthread_mutex_unlock(&r->lock);
+	reactor_wakeup(r);
+}
+
+/*
+ * Complete a list of commands linked by work_node, which may belong
+ * to endpoints on any reactor. Each reactor is locked and woken up
+ * only once for the whole batch.
+ */
+void reactor_complete_list(struct list_head *list)
+{
+	struct ep_qe *qe, *_qe;
+	struct reactor *r;
+
+	while (!list_empty(list)) {
+		qe = list_first_entry(list, struct ep_qe, work_node);
+		r = qe->ep->reactor;
+		pthread_mutex_lock(&r->lock);
+		list_for_each_entry_safe(qe, _qe, list, work_node) {
+			if (qe->ep->reactor == r)
+				list_move_tail(&qe->work_node, &r->done);
+		}
+		pthread_mutex_unlock(&r->lock);
+		reactor_wakeup(r);
+	}
+}
+
+void reactor_process_done(struct reactor *r)
+{
+	struct ep_qe *qe, *_qe;
+	struct endpoint *ep;
+	LIST_HEAD(done);
+	int ret;
+
+	pthread_mutex_lock(&r->lock);
+	list_splice_init(&r->done, &done);
+	pthread_mutex_unlock(&r->lock);
+
+	list_for_each_entry_safe(qe, _qe, &done, work_node) {
+		list_del_init(&qe->work_node);
+		ep = qe->ep;
+		ep->nr_work--;
+		if (ep->closing) {
+			tcp_release_tag(ep, qe);
+			if (!ep->nr_work && ep->release_pending)
+				reactor_release_endpoint(r, ep);
+			continue;
+		}
+		ret = handle_work_done(ep, qe);
+		if (!ret) {
+			if (r->uring)
+				ret = uring_flush(r, ep);
+			else {
+				ret = tcp_send_flush(ep);
+				if (!ret)
+					ret = reactor_update_events(r, ep);
+			}
+		}
+		if (ret < 0)
+			reactor_del_endpoint(r, ep);
+	}
+}
+
+static int reactor_poll(struct reactor *r, int timeout)
+{
+	struct epoll_event events[REACTOR_MAX_EVENTS];
+	struct endpoint *ep;
+	int i, n, ret;
+
+	n = epoll_wait(r->epollfd, events, REACTOR_MAX_EVENTS, timeout);
+	if (n < 0) {
+		if (errno == EINTR)
+			return 0;
+		fprintf(stderr, "reactor %d: epoll error %d\n",
+			r->id, errno);
+		return -errno;
+	}
+	for (i = 0; i < n; i++) {
+		ep = events[i].data.ptr;
+		if (!ep) {
+			u64 val;
+
+			if (read(r->eventfd, &val, sizeof(val)) < 0 &&
+			    errno != EAGAIN)
+				fprintf(stderr,
+					"reactor %d: eventfd error %d\n",
+					r->id, errno);
+			reactor_add_pending(r);
+			reactor_process_done(r);
+			continue;
+		}
+		ret = 0;
+		/* Zerocopy completions are signalled as EPOLLERR */
+		if (events[i].events & EPOLLERR && ep->zc_seq)
+			ret = tcp_zc_complete(ep);
+		if (!ret && events[i].events & EPOLLOUT)
+			ret = tcp_send_flush(ep);
+		if (!ret && events[i].events & ~EPOLLOUT) {
+			ep->kato_reset = true;
+			ret = endpoint_handle_event(ep);
+		}
+		if (!ret)
+			ret = reactor_update_events(r, ep);
+		if (ret < 0)
+			reactor_del_endpoint(r, ep);
+	}
+	return n;
+}
+
+/*
+ * Keep polling without blocking until nothing happened for r->spin
+ * usecs, and only then go to sleep in epoll_wait. This only pays off
+ * with a core to spare: sharing a CPU with its peer the spinning
+ * reactor delays the peer, and both p50 and p99 get worse.
+ */
+static int reactor_spin(struct reactor *r, int timeout)
+{
+	u64 end = reactor_now_us() + r->spin;
+	int ret;
+
+	do {
+		ret = reactor_poll(r, 0);
+		if (ret)
+			return ret;
+	} while (reactor_now_us() < end);
+
+	return reactor_poll(r, timeout);
+}
+
+static void *reactor_thread(void *arg)
+{
+	struct reactor *r = arg;
+	struct endpoint *ep, *_ep;
+	u64 next_tick, now;
+	sigset_t set;
+	int timeout, ret;
+
+	sigemptyset(&set);
+	sigaddset(&set, SIGPIPE);
+	pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+	next_tick = reactor_now_ms() + KATO_INTERVAL;
+	while (!r->stopping) {
+		now = reactor_now_ms();
+		timeout = next_tick > now ? next_tick - now : 0;
+		if (r->uring)
+			ret = uring_run(r, timeout);
+		else if (r->spin)
+			ret = reactor_spin(r, timeout);
+		else
+			ret = reactor_poll(r, timeout);
+		if (ret < 0)
+			break;
+		now = reactor_now_ms();
+		if (now >= next_tick) {
+			reactor_kato_tick(r);
+			next_tick = now + KATO_INTERVAL;
+		}
+	}
+
+	reactor_add_pending(r);
+	list_for_each_entry_safe(ep, _ep, &r->ep_list, reactor_node)
+		reactor_del_endpoint(r, ep);
+	/* Wait for outstanding io_uring requests and worker commands */
+	while (!list_empty(&r->ep_list)) {
+		if (r->uring)
+			ret = uring_run(r, KATO_INTERVAL);
+		else
+			ret = reactor_poll(r, KATO_INTERVAL);
+		if (ret < 0)
+			break;
+	}
+
+	pthread_exit(NULL);
+	return NULL;
+}
+
+/*
+ * Hand over an endpoint to a reactor. The endpoint is added to the
+ * epoll set from the reactor thread itself, so the reactor is the only
+ * one ever touching its endpoint list.
+ */
+int reactor_add_endpoint(struct endpoint *ep)
+{
+	struct reactor *r;
+	int i, num = nr_reactors, node = ep->iface->numa_node;
+	unsigned int next;
+
+	if (!num)
+		return -ESHUTDOWN;
+
+	next = __atomic_fetch_add(&reactor_next, 1, __ATOMIC_RELAXED);
+	r = &reactors[next % num];
+	/* Prefer a reactor on the NUMA node of the interface */
+	for (i = 0; node >= 0 && i < num; i++) {
+		if (reactors[(next + i) % num].node == node) {
+			r = &reactors[(next + i) % num];
+			break;
+		}
+	}
+	ep->reactor = r;
+	pthread_mutex_lock(&r->lock);
+	list_add_tail(&ep->reactor_node, &r->pending);
+	pthread_mutex_unlock(&r->lock);
+	reactor_wakeup(r);
+	return 0;
+}
+
+/*
+ * Let epoll_wait busy poll the NAPI contexts of the endpoint sockets.
+ */
+static void reactor_set_busy_poll(struct reactor *r, int usecs)
+{
+	struct epoll_params params;
+
+	memset(&params, 0, sizeof(params));
+	params.busy_poll_usecs = usecs;
+	params.busy_poll_budget = REACTOR_BUSY_POLL_BUDGET;
+	params.prefer_busy_poll = 1;
+	if (ioctl(r->epollfd, EPIOCSPARAMS, &params) < 0)
+		fprintf(stderr, "reactor %d: epoll busy poll error %d\n",
+			r->id, errno);
+}
+
+static void reactor_free(struct reactor *r)
+{
+	uring_exit(r);
+	pool_exit(&r->pool);
+	if (r->eventfd >= 0)
+		close(r->eventfd);
+	if (r->epollfd >= 0)
+		close(r->epollfd);
+	pthread_mutex_destroy(&r->lock);
+}
+
+int reactor_init(struct etcd_cdc_ctx *ctx)
+{
+	struct epoll_event ev;
+	int i, ret, num = ctx->nr_reactors;
+
+	if (num < 1)
+		num = 1;
+	if (ctx->io_uring && ctx->tls) {
+		fprintf(stderr, "TLS is not supported with io_uring, using epoll\n");
+		ctx->io_uring = 0;
+	}
+	reactors = calloc(num, sizeof(struct reactor));
+	if (!reactors)
+		return -ENOMEM;
+
+	for (i = 0; i < num; i++) {
+		struct reactor *r = &reactors[i];
+
+		r->id = i;
+		r->node = -1;
+		INIT_LIST_HEAD(&r->pending);
+		INIT_LIST_HEAD(&r->ep_list);
+		INIT_LIST_HEAD(&r->done);
+		pool_init(&r->pool, ctx->pool_size);
+		pthread_mutex_init(&r->lock, NULL);
+		r->eventfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		r->epollfd = epoll_create1(EPOLL_CLOEXEC);
+		if (r->eventfd < 0 || r->epollfd < 0) {
+			fprintf(stderr, "reactor %d: setup failed, error %d\n",
+				i, errno);
+			ret = -errno;
+			reactor_free(r);
+			goto out_free;
+		}
+		ev.events = EPOLLIN;
+		ev.data.ptr = NULL;
+		if (epoll_ctl(r->epollfd, EPOLL_CTL_ADD, r->eventfd, &ev) < 0) {
+			fprintf(stderr, "reactor %d: failed to add eventfd, error %d\n",
+				i, errno);
+			ret = -errno;
+			reactor_free(r);
+			goto out_free;
+		}
+		if (ctx->busy_poll)
+			reactor_set_busy_poll(r, ctx->busy_poll);
+		r->spin = ctx->spin;
+		/*
+		 * One CPU per reactor, wrapping around the configured set.
+		 * The node is known before the reactor can be picked.
+		 */
+		if (ctx->nr_cpus)
+			r->node = affinity_cpu_node(ctx->cpus[i % ctx->nr_cpus]);
+	}
+	/*
+	 * Rings are set up before any reactor runs, so that all of them
+	 * fall back to epoll if one cannot get a ring.
+	 */
+	for (i = 0; ctx->io_uring && i < num; i++) {
+		ret = uring_init(&reactors[i]);
+		if (ret < 0) {
+			fprintf(stderr,
+				"reactor %d: io_uring setup failed, error %d, using epoll\n",
+				i, -ret);
+			while (i--)
+				uring_exit(&reactors[i]);
+			ctx->io_uring = 0;
+		}
+	}
+	for (i = 0; i < num; i++) {
+		struct reactor *r = &reactors[i];
+
+		ret = pthread_create(&r->pthread, NULL, reactor_thread, r);
+		if (ret) {
+			fprintf(stderr, "reactor %d: failed to start, error %d\n",
+				i, ret);
+			ret = -ret;
+			goto out_stop;
+		}
+		if (ctx->nr_cpus)
+			affinity_pin(r->pthread, &ctx->cpus[i % ctx->nr_cpus], 1);
+		nr_reactors++;
+	}
+	printf("started %d %s reactors\n", nr_reactors,
+	       ctx->io_uring ? "io_uring" : "epoll");
+	return 0;
+
+out_stop:
+	/* Set up, but never started */
+	for (i = nr_reactors; i < num; i++)
+		reactor_free(&reactors[i]);
+	reactor_exit();
+	return ret;
+
+out_free:
+	while (i--)
+		reactor_free(&reactors[i]);
+	free(reactors);
+	reactors = NULL;
+	return ret;
+}
+
+void reactor_exit(void)
+{
+	int i, num = nr_reactors;
+
+	/* Stop new endpoints from being handed over */
+	nr_reactors = 0;
+	for (i = 0; i < num; i++) {
+		reactors[i].stopping = true;
+		reactor_wakeup(&reactors[i]);
+	}
+	for (i = 0; i < num; i++) {
+		pthread_join(reactors[i].pthread, NULL);
+		reactor_free(&reactors[i]);
+	}
+	free(reactors);
+	reactors = NULL;
+}
@@ -0,0 +1,14 @@
+#ifndef _NVMET_REACTOR_H
+#define _NVMET_REACTOR_H
+
+int reactor_init(struct etcd_cdc_ctx *ctx);
+void reactor_exit(void);
+int reactor_add_endpoint(struct endpoint *ep);
+void reactor_add_pending(struct reactor *r);
+void reactor_del_endpoint(struct reactor *r, struct endpoint *ep);
+void reactor_release_endpoint(struct reactor *r, struct endpoint *ep);
+void reactor_complete_work(struct ep_qe *qe);
+void reactor_complete_list(struct list_head *list);
+void reactor_process_done(struct reactor *r);
+
+#endif /* _NVMET_REACTOR_H */
@@ -2,23 +2,33 @@
 #include <stdbool.h>
 #include <stddef.h>
 #include <fcntl.h>
+#include <sys/uio.h>
 #include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/un.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <linux/errqueue.h>
 #include <netdb.h>
 
 #include "common.h"
 #include "tcp.h"
+#include "pool.h"
+#include "crc32c.h"
+#include "tls.h"
 
 #define NVME_OPCODE_MASK 0x3
 #define NVME_OPCODE_H2C  0x1
 #define NVME_OPCODE_C2H  0x2
 
-#define BACKLOG			16
 #define RESOLVE_TIMEOUT		5000
 #define EVENT_TIMEOUT		200
 
-#define TCP_SYNCNT		7
-#define TCP_NODELAY		1
+#define TCP_SEND_IOVS		32
+#define TCP_RX_SIZE		16384
+
+#define DIV_ROUND_UP(n, d)	(((n) + (d) - 1) / (d))
+
 
 #define tcp_info(e, f, x...)					\
 	if (tcp_debug) {					\
@@ -36,25 +46,435 @@
 		fflush(stderr);					\
 	} while (0)
 
+/*
+ * ICReq, ICResp and the termination PDUs never carry digests.
+ */
+static bool tcp_pdu_has_digest(u8 type)
+{
+	return type != nvme_tcp_icreq && type != nvme_tcp_icresp &&
+		type != nvme_tcp_h2c_term && type != nvme_tcp_c2h_term;
+}
+
+static int tcp_hdgst_len(struct endpoint *ep, u8 type)
+{
+	if (!ep->hdr_digest || !tcp_pdu_has_digest(type))
+		return 0;
+	return NVME_TCP_DIGEST_LENGTH;
+}
+
+static int tcp_ddgst_len(struct endpoint *ep, u64 data_len)
+{
+	return ep->data_digest && data_len ? NVME_TCP_DIGEST_LENGTH : 0;
+}
+
+/*
+ * Copy received data out of the receive buffer. Returns -1 with errno
+ * set to EAGAIN if the buffer is empty.
+ */
 static int tcp_ep_read(struct endpoint *ep, void *buf, size_t buf_len)
 {
-	return read(ep->sockfd, buf, buf_len);
+	size_t avail = ep->rx_tail - ep->rx_head;
+
+	if (!avail) {
+		errno = EAGAIN;
+		return -1;
+	}
+	if (buf_len > avail)
+		buf_len = avail;
+	memcpy(buf, ep->rx_buf + ep->rx_head, buf_len);
+	ep->rx_head += buf_len;
+	return buf_len;
+}
+
+/*
+ * Return the PDU at the head of the receive buffer once its header and
+ * header digest have been received in full, or NULL if more data is
+ * needed. The PDU is parsed in place and stays valid until the buffer
+ * is refilled.
+ */
+static union nvme_tcp_pdu *tcp_rx_peek(struct endpoint *ep)
+{
+	struct nvme_tcp_hdr *hdr;
+	size_t avail = ep->rx_tail - ep->rx_head;
+
+	if (avail < sizeof(*hdr))
+		return NULL;
+	hdr = (struct nvme_tcp_hdr *)(ep->rx_buf + ep->rx_head);
+	if (avail < hdr->hlen + tcp_hdgst_len(ep, hdr->type))
+		return NULL;
+	return (union nvme_tcp_pdu *)hdr;
+}
+
+/*
+ * Receive as much as fits into the receive buffer with a single read,
+ * moving any partial PDU left over to the start of the buffer first.
+ */
+int tcp_rx_fill(struct endpoint *ep)
+{
+	size_t avail = ep->rx_tail - ep->rx_head;
+	int len;
+
+	if (ep->rx_head) {
+		memmove(ep->rx_buf, ep->rx_buf + ep->rx_head, avail);
+		ep->rx_head = 0;
+		ep->rx_tail = avail;
+	}
+	if (ep->rx_tail == ep->rx_size)
+		return -ENOBUFS;
+	if (ep->tls_session && !ep->tls_ktls)
+		len = tls_recv(ep, ep->rx_buf + ep->rx_tail,
+			       ep->rx_size - ep->rx_tail);
+	else
+		len = read(ep->sockfd, ep->rx_buf + ep->rx_tail,
+			   ep->rx_size - ep->rx_tail);
+	if (len < 0) {
+		if (errno != EAGAIN)
+			tcp_err(ep, "read returned %d", errno);
+		return -errno;
+	}
+	if (!len) {
+		tcp_info(ep, "disconnect");
+		return -ENODATA;
+	}
+	tcp_info(ep, "received %d bytes", len);
+	ep->rx_tail += len;
+	return 0;
+}
+
+/*
+ * Build the iovec for the next sendmsg() from the send queue; @more is
+ * set if the queue holds more data than fits into @iov.
+ */
+int tcp_send_iov(struct endpoint *ep, struct iovec *iov, int max_iov,
+		 bool *more)
+{
+	struct ep_send *send;
+	int i, num = 0;
+
+	*more = false;
+	list_for_each_entry(send, &ep->send_list, node) {
+		for (i = 0; i < send->nr_iov; i++) {
+			if (!send->iov[i].iov_len)
+				continue;
+			if (num == max_iov) {
+				*more = true;
+				return num;
+			}
+			iov[num++] = send->iov[i];
+		}
+	}
+	return num;
+}
+
+static void tcp_send_free(struct endpoint *ep, struct ep_send *send)
+{
+	list_del(&send->node);
+	if (send->qe)
+		tcp_release_tag(ep, send->qe);
+	free(send);
+}
+
+/*
+ * Account for @len bytes having been sent; fully sent PDUs are
+ * removed from the queue and release the tag they own. PDUs sent
+ * with MSG_ZEROCOPY are parked on the zerocopy list instead, as the
+ * kernel still references their data.
+ */
+static void __tcp_send_complete(struct endpoint *ep, size_t len, bool zc)
+{
+	struct ep_send *send, *_send;
+	int i;
+
+	list_for_each_entry_safe(send, _send, &ep->send_list, node) {
+		if (zc && len) {
+			send->zc = true;
+			send->zc_seq = ep->zc_seq;
+		}
+		for (i = 0; i < send->nr_iov && len; i++) {
+			size_t n = send->iov[i].iov_len;
+
+			if (n > len)
+				n = len;
+			send->iov[i].iov_base = (u8 *)send->iov[i].iov_base + n;
+			send->iov[i].iov_len -= n;
+			len -= n;
+		}
+		for (i = 0; i < send->nr_iov; i++) {
+			if (send->iov[i].iov_len)
+				break;
+		}
+		if (i < send->nr_iov)
+			break;
+		/*
+		 * A PDU sent by copy may release a tag whose data an
+		 * earlier zerocopy PDU still references, so it waits for
+		 * the last zerocopy send before it.
+		 */
+		if (!send->zc && !list_empty(&ep->zc_list)) {
+			send->zc = true;
+			send->zc_seq = ep->zc_seq - 1;
+		}
+		if (send->zc)
+			list_move_tail(&send->node, &ep->zc_list);
+		else
+			tcp_send_free(ep, send);
+	}
+}
+
+void tcp_send_complete(struct endpoint *ep, size_t len)
+{
+	__tcp_send_complete(ep, len, false);
 }
 
-static int tcp_ep_write(struct endpoint *ep, void *buf, size_t buf_len)
+/*
+ * Reap MSG_ZEROCOPY completion notifications from the socket error
+ * queue and release the PDUs the kernel has finished with.
+ */
+int tcp_zc_complete(struct endpoint *ep)
 {
-	return write(ep->sockfd, buf, buf_len);
+	char control[CMSG_SPACE(sizeof(struct sock_extended_err))];
+	struct sock_extended_err *serr;
+	struct ep_send *send, *_send;
+	struct cmsghdr *cm;
+	struct msghdr msg;
+
+	for (;;) {
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+		if (recvmsg(ep->sockfd, &msg, MSG_ERRQUEUE) < 0) {
+			if (errno == EAGAIN)
+				return 0;
+			tcp_err(ep, "error queue read returned %d", errno);
+			return -errno;
+		}
+		cm = CMSG_FIRSTHDR(&msg);
+		if (!cm)
+			continue;
+		serr = (struct sock_extended_err *)CMSG_DATA(cm);
+		if (serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY ||
+		    serr->ee_errno != 0)
+			continue;
+		/* The kernel had to copy anyway, so stop pinning pages */
+		if (serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED &&
+		    ep->zerocopy) {
+			tcp_info(ep, "zerocopy fell back to copying");
+			ep->zerocopy = false;
+		}
+		/* Notifications for TCP arrive in order */
+		list_for_each_entry_safe(send, _send, &ep->zc_list, node) {
+			if ((__s32)(send->zc_seq - serr->ee_data) > 0)
+				break;
+			tcp_send_free(ep, send);
+		}
+	}
+}
+
+/*
+ * Write out as much of the send queue as the socket accepts, gathering
+ * all queued PDUs into a single sendmsg(). Returns 0 if the socket is
+ * full; the reactor then waits for EPOLLOUT as long as the queue is
+ * not empty.
+ */
+int tcp_send_flush(struct endpoint *ep)
+{
+	struct iovec iov[TCP_SEND_IOVS];
+	struct msghdr msg;
+	ssize_t len;
+	size_t total;
+	bool more;
+	int i, flags;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = iov;
+	while ((msg.msg_iovlen = tcp_send_iov(ep, iov, TCP_SEND_IOVS,
+					      &more)) > 0) {
+		flags = MSG_NOSIGNAL | (more ? MSG_MORE : 0);
+		if (ep->zerocopy) {
+			for (i = 0, total = 0; i < msg.msg_iovlen; i++)
+				total += iov[i].iov_len;
+			if (total >= ep->iface->ctx->zc_threshold)
+				flags |= MSG_ZEROCOPY;
+		}
+		/* Without kTLS each buffer becomes a TLS record of its own */
+		if (ep->tls_session && !ep->tls_ktls)
+			len = tls_send(ep, iov[0].iov_base, iov[0].iov_len);
+		else {
+			len = sendmsg(ep->sockfd, &msg, flags);
+			/* Out of option memory for pinning, copy instead */
+			if (len < 0 && errno == ENOBUFS &&
+			    flags & MSG_ZEROCOPY) {
+				flags &= ~MSG_ZEROCOPY;
+				len = sendmsg(ep->sockfd, &msg, flags);
+			}
+		}
+		if (len < 0) {
+			if (errno == EAGAIN)
+				return 0;
+			tcp_err(ep, "sendmsg returned %d", errno);
+			return -errno;
+		}
+		tcp_info(ep, "sent %zd bytes%s", len,
+			 flags & MSG_ZEROCOPY ? " (zerocopy)" : "");
+		__tcp_send_complete(ep, len, flags & MSG_ZEROCOPY);
+		if (flags & MSG_ZEROCOPY)
+			ep->zc_seq++;
+	}
+	return 0;
+}
+
+/*
+ * Queue a PDU for sending. The header is copied, the data is referenced
+ * and has to remain valid until it has been sent. If @qe is set the
+ * tag is released once the last byte of the PDU has left.
+ * The queue is flushed once all received PDUs have been handled, so
+ * all PDUs of a command go out with a single sendmsg().
+ * Digests are added here as negotiated, adjusting flags, pdo and plen.
+ */
+static int tcp_queue_sendv(struct endpoint *ep, void *hdr, size_t hdr_len,
+			   struct iovec *data, int nr_data, struct ep_qe *qe)
+{
+	struct nvme_tcp_hdr *h = hdr;
+	int hdgst = tcp_hdgst_len(ep, h->type), ddgst = 0;
+	int i, nr_iov = nr_data + 2;
+	size_t data_len = 0;
+	struct ep_send *send;
+	u32 crc;
+
+	send = malloc(sizeof(*send) + nr_iov * sizeof(struct iovec) +
+		      hdr_len + hdgst);
+	if (!send) {
+		tcp_err(ep, "no memory for send queue");
+		return -ENOMEM;
+	}
+	send->zc = false;
+	send->nr_iov = nr_iov;
+	send->hdr = (u8 *)&send->iov[nr_iov];
+	memcpy(send->hdr, hdr, hdr_len);
+	for (i = 0; i < nr_data; i++)
+		data_len += data[i].iov_len;
+	h = (struct nvme_tcp_hdr *)send->hdr;
+	if (tcp_pdu_has_digest(h->type)) {
+		ddgst = tcp_ddgst_len(ep, data_len);
+		if (hdgst)
+			h->flags |= NVME_TCP_F_HDGST;
+		if (ddgst) {
+			h->flags |= NVME_TCP_F_DDGST;
+			for (i = 0, crc = 0; i < nr_data; i++)
+				crc = crc32c(crc, data[i].iov_base,
+					     data[i].iov_len);
+			send->ddgst = htole32(crc);
+		}
+		if (data_len)
+			h->pdo = h->hlen + hdgst;
+		h->plen = htole32(le32toh(h->plen) + hdgst + ddgst);
+	}
+	if (hdgst) {
+		crc = htole32(crc32c(0, send->hdr, hdr_len));
+		memcpy(send->hdr + hdr_len, &crc, hdgst);
+	}
+	send->qe = qe;
+	send->iov[0].iov_base = send->hdr;
+	send->iov[0].iov_len = hdr_len + hdgst;
+	memcpy(&send->iov[1], data, nr_data * sizeof(struct iovec));
+	send->iov[nr_iov - 1].iov_base = &send->ddgst;
+	send->iov[nr_iov - 1].iov_len = ddgst;
+	list_add_tail(&send->node, &ep->send_list);
+	return 0;
+}
+
+static int tcp_queue_send(struct endpoint *ep, void *hdr, size_t hdr_len,
+			  void *data, size_t data_len, struct ep_qe *qe)
+{
+	struct iovec iov = {
+		.iov_base = data,
+		.iov_len = data_len,
+	};
+
+	return tcp_queue_sendv(ep, hdr, hdr_len, &iov, 1, qe);
+}
+
+/*
+ * The kernel copies zerocopy data destined for a local socket anyway,
+ * and with a small receive window that is a lot slower than copying
+ * right away.
+ */
+static bool tcp_peer_is_local(struct endpoint *ep)
+{
+	struct sockaddr_storage local, peer;
+	socklen_t local_len = sizeof(local), peer_len = sizeof(peer);
+
+	if (getsockname(ep->sockfd, (struct sockaddr *)&local, &local_len) < 0 ||
+	    getpeername(ep->sockfd, (struct sockaddr *)&peer, &peer_len) < 0)
+		return false;
+	if (peer.ss_family == AF_INET) {
+		struct in_addr *l = &((struct sockaddr_in *)&local)->sin_addr;
+		struct in_addr *p = &((struct sockaddr_in *)&peer)->sin_addr;
+
+		return (ntohl(p->s_addr) >> 24) == IN_LOOPBACKNET ||
+			l->s_addr == p->s_addr;
+	}
+	if (peer.ss_family == AF_INET6) {
+		struct in6_addr *l = &((struct sockaddr_in6 *)&local)->sin6_addr;
+		struct in6_addr *p = &((struct sockaddr_in6 *)&peer)->sin6_addr;
+
+		return IN6_IS_ADDR_LOOPBACK(p) ||
+			!memcmp(l, p, sizeof(*p));
+	}
+	return true;
 }
 
 int tcp_create_endpoint(struct endpoint *ep, int id)
 {
-	int flags, i;
+	int flags, one = 1;
 
 	ep->sockfd = id;
+	INIT_LIST_HEAD(&ep->send_list);
+	INIT_LIST_HEAD(&ep->zc_list);
 
 	flags = fcntl(ep->sockfd, F_GETFL);
 	fcntl(ep->sockfd, F_SETFL, flags | O_NONBLOCK);
+	/* None of the options below apply to AF_UNIX */
+	if (ep->iface->adrfam == AF_UNIX)
+		return 0;
+	/* PDUs are gathered in the send queue, don't delay them further */
+	if (setsockopt(ep->sockfd, IPPROTO_TCP, TCP_NODELAY,
+		       &one, sizeof(one)) < 0)
+		tcp_err(ep, "failed to set TCP_NODELAY, error %d", errno);
+	/*
+	 * TLS records are built from a copy anyway, and io_uring
+	 * endpoints are sent from the ring.
+	 */
+	if (ep->iface->ctx->zc_threshold && !ep->iface->ctx->tls &&
+	    !ep->iface->ctx->io_uring && !tcp_peer_is_local(ep)) {
+		if (setsockopt(ep->sockfd, SOL_SOCKET, SO_ZEROCOPY,
+			       &one, sizeof(one)) < 0)
+			tcp_err(ep, "failed to set SO_ZEROCOPY, error %d",
+				errno);
+		else
+			ep->zerocopy = true;
+	}
+
+	if (ep->iface->ctx->busy_poll) {
+		int usecs = ep->iface->ctx->busy_poll;
 
+		if (setsockopt(ep->sockfd, SOL_SOCKET, SO_BUSY_POLL,
+			       &usecs, sizeof(usecs)) < 0 ||
+		    setsockopt(ep->sockfd, SOL_SOCKET, SO_PREFER_BUSY_POLL,
+			       &one, sizeof(one)) < 0)
+			tcp_err(ep, "failed to enable busy polling, error %d",
+				errno);
+	}
+	return 0;
+}
+
+/*
+ * Called from the reactor owning the endpoint, so that with pinned
+ * reactors the buffers are first touched and thus placed on the NUMA
+ * node the endpoint is served from.
+ */
+int tcp_alloc_buffers(struct endpoint *ep)
+{
 	ep->send_pdu = malloc(sizeof(union nvme_tcp_pdu));
 	if (!ep->send_pdu) {
 		tcp_err(ep, "no memory");
@@ -62,86 +482,225 @@ int tcp_create_endpoint(struct endpoint *ep, int id)
 	}
 	memset(ep->send_pdu, 0, sizeof(union nvme_tcp_pdu));
 
-	ep->recv_pdu = malloc(sizeof(union nvme_tcp_pdu));
-	if (!ep->recv_pdu) {
+	ep->recv_hdr = malloc(sizeof(union nvme_tcp_pdu));
+	if (!ep->recv_hdr) {
 		free(ep->send_pdu);
 		ep->send_pdu = NULL;
 		tcp_err(ep, "no memory");
 		return -ENOMEM;
 	}
-	memset(ep->recv_pdu, 0, sizeof(union nvme_tcp_pdu));
+	memset(ep->recv_hdr, 0, sizeof(union nvme_tcp_pdu));
 
-	ep->qes = calloc(NVMF_SQ_DEPTH, sizeof(struct ep_qe));
-	if (!ep->qes) {
-		free(ep->recv_pdu);
-		ep->recv_pdu = NULL;
+	ep->rx_buf = malloc(TCP_RX_SIZE);
+	if (!ep->rx_buf) {
+		free(ep->recv_hdr);
+		ep->recv_hdr = NULL;
 		free(ep->send_pdu);
 		ep->send_pdu = NULL;
+		tcp_err(ep, "no memory");
 		return -ENOMEM;
 	}
-	ep->qsize = NVMF_SQ_DEPTH;
-	for (i = 0; i < ep->qsize; i++) {
-		ep->qes[i].tag = i;
-		ep->qes[i].ep = ep;
+	ep->rx_size = TCP_RX_SIZE;
+	ep->rx_head = ep->rx_tail = 0;
+
+	if (tcp_alloc_tags(ep, NVMF_SQ_DEPTH) < 0) {
+		free(ep->rx_buf);
+		ep->rx_buf = NULL;
+		free(ep->recv_hdr);
+		ep->recv_hdr = NULL;
+		free(ep->send_pdu);
+		ep->send_pdu = NULL;
+		return -ENOMEM;
 	}
 	return 0;
 }
 
+/*
+ * Pages sent with MSG_ZEROCOPY stay referenced by the kernel until it
+ * reports completion, which it can no longer do once the socket is
+ * closed. Anything still in flight then might be transmitted from
+ * memory which has been reused, so the PDUs and the data of all busy
+ * tags are leaked deliberately rather than returned to the pool; any
+ * busy tag may own data one of those PDUs points to.
+ */
+static void tcp_zc_leak(struct endpoint *ep, int nr_sends)
+{
+	struct ep_qe *qe;
+	int i;
+
+	tcp_err(ep, "leaking %d PDUs with zerocopy sends outstanding",
+		nr_sends);
+	for (i = 0; ep->qes && i < ep->qsize; i++) {
+		qe = &ep->qes[i];
+		if (!qe->busy)
+			continue;
+		qe->data = NULL;
+		qe->data_len = 0;
+		qe->data_put = NULL;
+		qe->data_ref = NULL;
+	}
+}
+
 void tcp_destroy_endpoint(struct endpoint *ep)
 {
+	struct ep_send *send, *_send;
+	int i, leaked = 0;
+
+	if (!list_empty(&ep->zc_list) && ep->sockfd >= 0)
+		tcp_zc_complete(ep);
+	list_for_each_entry_safe(send, _send, &ep->send_list, node) {
+		list_del(&send->node);
+		if (send->zc)
+			leaked++;
+		else
+			free(send);
+	}
+	list_for_each_entry_safe(send, _send, &ep->zc_list, node) {
+		list_del(&send->node);
+		leaked++;
+	}
+	if (leaked)
+		tcp_zc_leak(ep, leaked);
 	if (ep->qes) {
+		for (i = 0; i < ep->qsize; i++)
+			tcp_release_tag(ep, &ep->qes[i]);
 		free(ep->qes);
 		ep->qes = NULL;
+		free(ep->tag_map);
+		ep->tag_map = NULL;
 	}
-	if (ep->recv_pdu) {
-		free(ep->recv_pdu);
-		ep->recv_pdu = NULL;
+	if (ep->recv_hdr) {
+		free(ep->recv_hdr);
+		ep->recv_hdr = NULL;
 	}
+	ep->recv_pdu = NULL;
 	if (ep->send_pdu) {
 		free(ep->send_pdu);
 		ep->send_pdu = NULL;
 	}
+	if (ep->rx_buf) {
+		free(ep->rx_buf);
+		ep->rx_buf = NULL;
+	}
+	tls_free(ep);
 	if (ep->sockfd >= 0) {
 		close(ep->sockfd);
 		ep->sockfd = -1;
 	}
 }
 
+/*
+ * (Re-)allocate the tags for a queue of @qsize entries. Free tags are
+ * tracked in a bitmap, so acquiring one is a find-first-set over at
+ * most qsize / 64 words instead of a scan over all queue entries.
+ */
+int tcp_alloc_tags(struct endpoint *ep, int qsize)
+{
+	int i, words = DIV_ROUND_UP(qsize, 64);
+	struct ep_qe *qes;
+	u64 *map;
+
+	qes = calloc(qsize, sizeof(struct ep_qe));
+	map = calloc(words, sizeof(u64));
+	if (!qes || !map) {
+		free(qes);
+		free(map);
+		return -ENOMEM;
+	}
+	for (i = 0; i < qsize; i++) {
+		qes[i].tag = i;
+		qes[i].ep = ep;
+		map[i / 64] |= 1ULL << (i % 64);
+	}
+	free(ep->qes);
+	free(ep->tag_map);
+	ep->qes = qes;
+	ep->tag_map = map;
+	ep->qsize = qsize;
+	return 0;
+}
+
+/*
+ * Resize the queue from its connect command. The queue entries are
+ * reallocated, so no command other than the connect command @qe may
+ * be outstanding; @qe keeps its tag and is moved to the new array.
+ * On success @qe is updated to point to its new location.
+ */
+int tcp_resize_tags(struct endpoint *ep, int qsize, struct ep_qe **qe)
+{
+	struct ep_qe *old_qes = ep->qes, *old = *qe, *new;
+	u64 *old_map = ep->tag_map;
+	int i, old_qsize = ep->qsize, ret;
+
+	for (i = 0; i < old_qsize; i++) {
+		if (old_qes[i].busy && &old_qes[i] != old) {
+			tcp_err(ep, "tag %#x busy, cannot resize queue", i);
+			return -EBUSY;
+		}
+	}
+	if (old->tag >= qsize)
+		return -EINVAL;
+
+	ep->qes = NULL;
+	ep->tag_map = NULL;
+	ret = tcp_alloc_tags(ep, qsize);
+	if (ret < 0) {
+		ep->qes = old_qes;
+		ep->tag_map = old_map;
+		ep->qsize = old_qsize;
+		return ret;
+	}
+	/* Carries the data buffer over, which is released with the tag */
+	new = &ep->qes[old->tag];
+	*new = *old;
+	INIT_LIST_HEAD(&new->node);
+	INIT_LIST_HEAD(&new->work_node);
+	ep->tag_map[new->tag / 64] &= ~(1ULL << (new->tag % 64));
+	free(old_qes);
+	free(old_map);
+	*qe = new;
+	return 0;
+}
+
 struct ep_qe *tcp_acquire_tag(struct endpoint *ep, union nvme_tcp_pdu *pdu,
 			      u16 ccid, u64 pos, u64 len)
 {
-	int i;
+	int i, words = DIV_ROUND_UP(ep->qsize, 64);
+	struct ep_qe *qe;
 
-	for (i = 0; i < ep->qsize; i++) {
-		struct ep_qe *qe = &ep->qes[i];
-
-		if (!qe->busy) {
-			qe->busy = true;
-			qe->ccid = ccid;
-			if (len) {
-				qe->data = malloc(len);
-				if (!qe->data) {
-					tcp_err(ep,
-						"Error allocating iovec base");
-					return NULL;
-				}
-				memset(qe->data, 0, len);
-				qe->data_pos = pos;
-				qe->data_len = len;
-				qe->iovec.iov_base = NULL;
-				qe->iovec.iov_len = 0;
-				qe->iovec_offset = 0;
-				qe->data_remaining = 0;
-			}
-			memcpy(&qe->pdu, pdu,
-			       sizeof(union nvme_tcp_pdu));
-			memset(&qe->resp, 0, sizeof(qe->resp));
-			qe->resp.command_id = 0xffff;
-			tcp_info(ep, "acquire tag %#x", qe->tag);
-			return qe;
+	for (i = 0; i < words; i++) {
+		if (ep->tag_map[i])
+			break;
+	}
+	if (i == words)
+		return NULL;
+
+	qe = &ep->qes[i * 64 + __builtin_ctzll(ep->tag_map[i])];
+	if (len) {
+		/* Not zeroed, the command handlers fill in what they send */
+		if (ep->reactor)
+			qe->data = pool_alloc(&ep->reactor->pool, len);
+		else
+			qe->data = malloc(len);
+		if (!qe->data) {
+			tcp_err(ep, "Error allocating iovec base");
+			return NULL;
 		}
+		qe->data_pos = pos;
+		qe->data_len = len;
+		qe->iovec.iov_base = NULL;
+		qe->iovec.iov_len = 0;
+		qe->iovec_offset = 0;
+		qe->data_remaining = 0;
 	}
-	return NULL;
+	ep->tag_map[i] &= ~(1ULL << (qe->tag % 64));
+	qe->busy = true;
+	qe->ccid = ccid;
+	memcpy(&qe->pdu, pdu, pdu->common.hlen);
+	memset(&qe->resp, 0, sizeof(qe->resp));
+	qe->resp.command_id = 0xffff;
+	tcp_info(ep, "acquire tag %#x", qe->tag);
+	return qe;
 }
 
 struct ep_qe *tcp_get_tag(struct endpoint *ep, u16 tag)
@@ -155,52 +714,84 @@ void tcp_release_tag(struct endpoint *ep, struct ep_qe *qe)
 {
 	if (!qe)
 		return;
-	if (&ep->qes[qe->tag] != qe)
+	if (&ep->qes[qe->tag] != qe || !qe->busy)
 		return;
 
 	qe->busy = false;
+	ep->tag_map[qe->tag / 64] |= 1ULL << (qe->tag % 64);
 	if (qe->data) {
-		free(qe->data);
+		if (ep->reactor)
+			pool_free(&ep->reactor->pool, qe->data, qe->data_len);
+		else
+			free(qe->data);
 		qe->data = NULL;
-		qe->data_len = 0;
+	}
+	qe->data_len = 0;
+	if (qe->data_iov) {
+		free(qe->data_iov);
+		qe->data_iov = NULL;
+		qe->data_iovcnt = 0;
+		qe->data_iov_idx = 0;
+	}
+	if (qe->data_put) {
+		qe->data_put(qe->data_ref);
+		qe->data_put = NULL;
+		qe->data_ref = NULL;
 	}
 	qe->iovec.iov_base = NULL;
 	qe->iovec.iov_len = 0;
 	tcp_info(ep, "release tag %#x", qe->tag);
 }
 
-int tcp_init_listener(struct interface *iface)
+/*
+ * Socket options only applicable to TCP listeners.
+ */
+static int tcp_set_listener_opts(struct interface *iface, int listenfd)
 {
-	int listenfd;
-	int ret;
-	struct addrinfo *ai, hints;
-
-	memset(&hints, 0, sizeof(hints));
-	hints.ai_family = iface->adrfam;
-	hints.ai_socktype = SOCK_STREAM;
-	hints.ai_protocol = IPPROTO_TCP;
-	hints.ai_flags = AI_NUMERICSERV | AI_PASSIVE;
+	struct etcd_cdc_ctx *ctx = iface->ctx;
+	int on = 1;
 
-	ret = getaddrinfo(iface->port.traddr, iface->port.trsvcid,
-			  &hints, &ai);
-	if (ret != 0) {
-		fprintf(stderr, "iface %d: getaddrinfo() failed: %s\n",
-			iface->portid, gai_strerror(ret));
-		return -EINVAL;
-	}
-	if (!ai) {
-		fprintf(stderr, "iface %d: no results from getaddrinfo()\n",
-			iface->portid);
-		return -EHOSTUNREACH;
+	/* Let the kernel spread incoming connections over all listeners */
+	if (setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0) {
+		fprintf(stderr, "iface %d: SO_REUSEPORT error %d\n",
+			iface->portid, errno);
+		return -errno;
 	}
 
-	listenfd = socket(ai->ai_family, ai->ai_socktype,
+	/* Both are optimizations only, so failures are not fatal */
+	if (ctx->fastopen &&
+	    setsockopt(listenfd, IPPROTO_TCP, TCP_FASTOPEN,
+		       &ctx->fastopen, sizeof(ctx->fastopen)) < 0)
+		fprintf(stderr, "iface %d: TCP_FASTOPEN error %d\n",
+			iface->portid, errno);
+	if (ctx->defer_accept &&
+	    setsockopt(listenfd, IPPROTO_TCP, TCP_DEFER_ACCEPT,
+		       &ctx->defer_accept, sizeof(ctx->defer_accept)) < 0)
+		fprintf(stderr, "iface %d: TCP_DEFER_ACCEPT error %d\n",
+			iface->portid, errno);
+	return 0;
+}
+
+static int tcp_create_listener(struct interface *iface, struct addrinfo *ai)
+{
+	int listenfd, ret;
+
+	listenfd = socket(ai->ai_family,
+			  ai->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC,
 			  ai->ai_protocol);
 	if (listenfd < 0) {
 		fprintf(stderr, "iface %d: socket error %d\n",
 			iface->portid, errno);
-		ret = -errno;
-		goto err_free;
+		return -errno;
+	}
+
+	if (ai->ai_family == AF_UNIX) {
+		/* Remove a stale socket left over from a previous run */
+		unlink(((struct sockaddr_un *)ai->ai_addr)->sun_path);
+	} else {
+		ret = tcp_set_listener_opts(iface, listenfd);
+		if (ret < 0)
+			goto err_close;
 	}
 
 	ret = bind(listenfd, ai->ai_addr, ai->ai_addrlen);
@@ -211,93 +802,172 @@ int tcp_init_listener(struct interface *iface)
 		ret = -errno;
 		goto err_close;
 	}
-	if (ai->ai_next)
-		fprintf(stderr, "iface %d: duplicate addresses\n",
-			iface->portid);
-	freeaddrinfo(ai);
 
-	ret = listen(listenfd, BACKLOG);
+	ret = listen(listenfd, iface->ctx->backlog);
 	if (ret < 0) {
 		fprintf(stderr, "iface %d: socket listen error %d\n",
 			iface->portid, errno);
 		ret = -errno;
 		goto err_close;
 	}
-	iface->listenfd = listenfd;
-	return 0;
+	return listenfd;
 err_close:
 	close(listenfd);
-err_free:
-	freeaddrinfo(ai);
 	return ret;
 }
 
-void tcp_destroy_listener(struct interface *iface)
+/*
+ * AF_UNIX listeners speak the same PDU framing as TCP ones, with the
+ * socket path as traddr.
+ */
+static int tcp_unix_addrinfo(struct interface *iface, struct addrinfo *ai,
+			     struct sockaddr_un *sun)
 {
-	if (iface->listenfd < 0)
-		return;
-	close(iface->listenfd);
-	iface->listenfd = -1;
+	if (strlen(iface->port.traddr) >= sizeof(sun->sun_path)) {
+		fprintf(stderr, "iface %d: socket path '%s' too long\n",
+			iface->portid, iface->port.traddr);
+		return -ENAMETOOLONG;
+	}
+	memset(sun, 0, sizeof(*sun));
+	sun->sun_family = AF_UNIX;
+	strcpy(sun->sun_path, iface->port.traddr);
+	memset(ai, 0, sizeof(*ai));
+	ai->ai_family = AF_UNIX;
+	ai->ai_socktype = SOCK_STREAM;
+	ai->ai_addr = (struct sockaddr *)sun;
+	ai->ai_addrlen = sizeof(*sun);
+	return 0;
 }
 
-int tcp_accept_connection(struct endpoint *ep)
+int tcp_init_listener(struct interface *iface)
 {
-	struct nvme_tcp_icreq_pdu *icreq = NULL;
-	struct nvme_tcp_icresp_pdu *icrep;
-	int ret, len, hdr_len;
-
-	if (!ep)
-		return -EINVAL;
-
-	icreq = malloc(sizeof(*icreq));
-	if (!icreq)
-		return -ENOMEM;
+	int i, ret, num = iface->ctx->nr_listeners;
+	struct addrinfo *ai, hints, unix_ai;
+	struct sockaddr_un sun;
+	struct epoll_event ev;
+
+	if (num < 1)
+		num = 1;
+
+	if (iface->adrfam == AF_UNIX) {
+		/* Only one socket can be bound to a path */
+		num = 1;
+		ret = tcp_unix_addrinfo(iface, &unix_ai, &sun);
+		if (ret < 0)
+			return ret;
+		ai = &unix_ai;
+		goto create;
+	}
 
-	memset(icreq, 0, sizeof(*icreq));
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = iface->adrfam;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_protocol = IPPROTO_TCP;
+	hints.ai_flags = AI_NUMERICSERV | AI_PASSIVE;
 
-	hdr_len = sizeof(struct nvme_tcp_hdr);
-	ret = tcp_ep_read(ep, icreq, hdr_len);
-	if (ret < 0) {
-		if (errno != EAGAIN)
-			tcp_err(ep, "icreq header read, error %d", errno);
-		return -errno;
+	ret = getaddrinfo(iface->port.traddr, iface->port.trsvcid,
+			  &hints, &ai);
+	if (ret != 0) {
+		fprintf(stderr, "iface %d: getaddrinfo() failed: %s\n",
+			iface->portid, gai_strerror(ret));
+		return -EINVAL;
 	}
-	if (ret != hdr_len) {
-		tcp_err(ep, "icreq short header read, %d bytes missing",
-			hdr_len - ret);
-		ret = (ret < 0) ? -EAGAIN : -ENODATA;
-		goto out_free;
+	if (!ai) {
+		fprintf(stderr, "iface %d: no results from getaddrinfo()\n",
+			iface->portid);
+		return -EHOSTUNREACH;
 	}
+	if (ai->ai_next)
+		fprintf(stderr, "iface %d: duplicate addresses\n",
+			iface->portid);
 
-	if (icreq->hdr.type == 0) {
-		len = icreq->hdr.hlen - hdr_len;
-		ret = tcp_ep_read(ep, (u8 *)icreq + hdr_len, len);
+create:
+	iface->listenfd = calloc(num, sizeof(int));
+	if (!iface->listenfd) {
+		ret = -ENOMEM;
+		goto err_free;
+	}
+	iface->epollfd = epoll_create1(EPOLL_CLOEXEC);
+	if (iface->epollfd < 0) {
+		fprintf(stderr, "iface %d: epoll error %d\n",
+			iface->portid, errno);
+		ret = -errno;
+		goto err_destroy;
+	}
+	for (i = 0; i < num; i++) {
+		ret = tcp_create_listener(iface, ai);
+		if (ret < 0)
+			goto err_destroy;
+		iface->listenfd[i] = ret;
+		iface->nr_listeners++;
+		ev.events = EPOLLIN;
+		ev.data.fd = ret;
+		ret = epoll_ctl(iface->epollfd, EPOLL_CTL_ADD,
+				iface->listenfd[i], &ev);
 		if (ret < 0) {
-			tcp_err(ep, "icreq read error %d", errno);
+			fprintf(stderr, "iface %d: failed to add listener, error %d\n",
+				iface->portid, errno);
 			ret = -errno;
-			goto out_free;
-		}
-		if (ret != len) {
-			tcp_err(ep, "icreq short read, %d bytes missing",
-			       len - ret);
-			ret = -ENODATA;
-			goto out_free;
-		}
-		if (icreq->hpda != 0) {
-			ret = -EPROTO;
-			goto out_free;
+			goto err_destroy;
 		}
-		ep->maxr2t = le32toh(icreq->maxr2t) + 1;
 	}
+	if (ai != &unix_ai)
+		freeaddrinfo(ai);
+	return 0;
+err_destroy:
+	tcp_destroy_listener(iface);
+err_free:
+	if (ai != &unix_ai)
+		freeaddrinfo(ai);
+	return ret;
+}
 
-	tcp_info(ep, "read %d icreq bytes (type %d, maxr2t %u)",
-		icreq->hdr.hlen, icreq->hdr.type, icreq->maxr2t);
+void tcp_destroy_listener(struct interface *iface)
+{
+	int i;
 
-	icrep = malloc(sizeof(*icrep));
-	if (!icrep) {
-		ret = -ENOMEM;
-		goto out_free;
+	if (iface->adrfam == AF_UNIX && iface->nr_listeners)
+		unlink(iface->port.traddr);
+	for (i = 0; i < iface->nr_listeners; i++)
+		close(iface->listenfd[i]);
+	iface->nr_listeners = 0;
+	free(iface->listenfd);
+	iface->listenfd = NULL;
+	if (iface->epollfd >= 0)
+		close(iface->epollfd);
+	iface->epollfd = -1;
+}
+
+int tcp_accept_connection(struct endpoint *ep)
+{
+	struct nvme_tcp_icreq_pdu *icreq;
+	struct nvme_tcp_icresp_pdu *icrep = &ep->send_pdu->icresp;
+	union nvme_tcp_pdu *pdu;
+	int ret;
+
+	if (!ep)
+		return -EINVAL;
+
+	pdu = tcp_rx_peek(ep);
+	if (!pdu)
+		return -EAGAIN;
+	icreq = &pdu->icreq;
+	if (icreq->hdr.type != nvme_tcp_icreq ||
+	    icreq->hdr.hlen != sizeof(*icreq)) {
+		tcp_err(ep, "invalid icreq type %d hlen %d",
+			icreq->hdr.type, icreq->hdr.hlen);
+		return -EPROTO;
 	}
+	ep->rx_head += icreq->hdr.hlen;
+	if (icreq->hpda != 0)
+		return -EPROTO;
+	ep->maxr2t = le32toh(icreq->maxr2t) + 1;
+	ep->hdr_digest = icreq->digest & NVME_TCP_HDR_DIGEST_ENABLE;
+	ep->data_digest = icreq->digest & NVME_TCP_DATA_DIGEST_ENABLE;
+
+	tcp_info(ep, "read %d icreq bytes (type %d, maxr2t %u, digest %x)",
+		icreq->hdr.hlen, icreq->hdr.type, icreq->maxr2t,
+		icreq->digest);
 
 	memset(icrep, 0, sizeof(*icrep));
 	icrep->hdr.type = nvme_tcp_icresp;
@@ -305,117 +975,255 @@ int tcp_accept_connection(struct endpoint *ep)
 	icrep->hdr.pdo = 0;
 	icrep->hdr.plen = htole32(sizeof(*icrep));
 	icrep->pfv = htole16(NVME_TCP_PFV_1_0);
-	icrep->maxdata = 0xf000;
+	icrep->maxdata = htole32(ep->maxh2cdata);
 	icrep->cpda = 0;
-	icrep->digest = 0;
+	icrep->digest = (ep->hdr_digest ? NVME_TCP_HDR_DIGEST_ENABLE : 0) |
+		(ep->data_digest ? NVME_TCP_DATA_DIGEST_ENABLE : 0);
+
+	ret = tcp_queue_send(ep, icrep, sizeof(*icrep), NULL, 0, NULL);
+	if (ret < 0)
+		tcp_err(ep, "icresp write error %d", ret);
+	else
+		tcp_info(ep, "queued %zu icresp bytes", sizeof(*icrep));
+	return ret;
+}
 
-	len = tcp_ep_write(ep, icrep, sizeof(*icrep));
-	if (len < 0) {
-		tcp_err(ep, "icresp write error %d", errno);
+/*
+ * Wait for incoming connections on any of the interface listeners.
+ * Fills in the ready listening sockets and returns their number.
+ */
+int tcp_wait_for_connection(struct interface *iface, int *fds, int max_fds,
+			    int timeout_ms)
+{
+	struct epoll_event events[max_fds];
+	int i, n;
+
+	n = epoll_wait(iface->epollfd, events, max_fds, timeout_ms);
+	if (n < 0) {
+		if (errno == EINTR)
+			return -EAGAIN;
+		fprintf(stderr, "iface %d: epoll error %d\n",
+			iface->portid, errno);
 		return -errno;
 	}
-	if (len != sizeof(*icrep)) {
-		tcp_err(ep, "icrep short write, %ld bytes missing",
-			sizeof(*icrep) - len);
-		ret = -ENODATA;
-	} else {
-		tcp_info(ep, "wrote %d icresp bytes", len);
-		ret = 0;
-	}
-
-	free(icrep);
-out_free:
-	free(icreq);
-	return ret;
+	if (!n)
+		return -ETIMEDOUT;
+	for (i = 0; i < n; i++)
+		fds[i] = events[i].data.fd;
+	return n;
 }
 
-int tcp_wait_for_connection(struct interface *iface, int timeout_ms)
+/*
+ * Accept one pending connection from a ready listener.
+ * Returns -EAGAIN once the accept queue is drained.
+ */
+int tcp_accept(struct interface *iface, int listenfd)
 {
 	int sockfd;
-	int ret = -ESHUTDOWN;
 
-	while (!stopped) {
-		fd_set rfd;
-		struct timeval tmo;
+	do {
+		sockfd = accept4(listenfd, NULL, NULL,
+				 SOCK_NONBLOCK | SOCK_CLOEXEC);
+	} while (sockfd < 0 && (errno == EINTR || errno == ECONNABORTED));
+	if (sockfd < 0) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK)
+			return -EAGAIN;
+		fprintf(stderr, "iface %d: failed to accept error %d\n",
+			iface->portid, errno);
+		return -errno;
+	}
+	return sockfd;
+}
 
-		FD_ZERO(&rfd);
-		FD_SET(iface->listenfd, &rfd);
-		tmo.tv_sec = iface->ctx->ttl / 5;
-		tmo.tv_usec = 0;
-		ret = select(iface->listenfd + 1, &rfd, NULL, NULL, &tmo);
-		if (ret < 0) {
-			fprintf(stderr, "iface %d: select error %d\n",
-				iface->portid, errno);
-			ret = -errno;
-			break;
-		}
-		if (ret > 0)
-			break;
+static void tcp_start_recv_data(struct endpoint *ep, struct ep_qe *qe,
+				u64 len)
+{
+	/*
+	 * The PDU header lives in the receive buffer, which is reused
+	 * when more data arrives; keep a copy if the payload is incomplete.
+	 */
+	if (ep->recv_pdu != ep->recv_hdr &&
+	    ep->rx_tail - ep->rx_head < len + tcp_ddgst_len(ep, len)) {
+		memcpy(ep->recv_hdr, ep->recv_pdu, ep->recv_pdu->common.hlen);
+		ep->recv_pdu = ep->recv_hdr;
+	}
+	qe->recv_offset = 0;
+	qe->recv_len = len;
+	ep->recv_qe = qe;
+	ep->recv_state = RECV_DATA;
+}
+
+/*
+ * Start receiving the in-capsule data following the command PDU header.
+ * Returns 1 if the command has to wait for the data, 0 if the command
+ * does not carry any in-capsule data.
+ */
+int tcp_recv_incapsule_data(struct endpoint *ep, struct ep_qe *qe)
+{
+	struct nvme_tcp_hdr *hdr = &ep->recv_pdu->common;
+	u32 plen = le32toh(hdr->plen);
+	u32 len = hdr->hlen + tcp_hdgst_len(ep, hdr->type);
+	int ddgst;
+
+	if (plen < len) {
+		tcp_err(ep, "invalid plen %u", plen);
+		tcp_release_tag(ep, qe);
+		return tcp_send_c2h_term(ep, NVME_TCP_FES_INVALID_PDU_HDR,
+					 offsetof(struct nvme_tcp_hdr, plen),
+					 0, false, ep->recv_pdu, hdr->hlen);
+	}
+	len = plen - len;
+	ddgst = tcp_ddgst_len(ep, len);
+	/* In-capsule data is never empty when followed by a digest */
+	if (ddgst && len <= ddgst) {
+		tcp_err(ep, "invalid plen %u, no room for data and digest",
+			plen);
+		tcp_release_tag(ep, qe);
+		return tcp_send_c2h_term(ep, NVME_TCP_FES_INVALID_PDU_HDR,
+					 offsetof(struct nvme_tcp_hdr, plen),
+					 0, false, ep->recv_pdu, hdr->hlen);
+	}
+	len -= ddgst;
+	qe->recv_len = len;
+	if (!len)
+		return 0;
+	if (!qe->data || len > qe->data_len) {
+		tcp_err(ep, "in-capsule data overflow, is %u exp %llu",
+			len, qe->data_len);
+		tcp_release_tag(ep, qe);
+		return tcp_send_c2h_term(ep, NVME_TCP_FES_DATA_LIMIT_EXCEEDED,
+					 offsetof(struct nvme_tcp_hdr, plen),
+					 0, false, ep->recv_pdu, hdr->hlen);
 	}
+	tcp_info(ep, "in-capsule data cid %x len %u", qe->ccid, len);
+	if (len < qe->data_len)
+		memset((u8 *)qe->data + len, 0, qe->data_len - len);
+	qe->iovec.iov_base = qe->data;
+	qe->iovec.iov_len = len;
+	tcp_start_recv_data(ep, qe, len);
+	return 1;
+}
 
-	if (ret <= 0)
-		return ret ? ret : -ETIMEDOUT;
+static int tcp_complete_h2c_data(struct endpoint *ep, struct ep_qe *qe)
+{
+	u8 *data = qe->iovec.iov_base;
 
-	sockfd = accept(iface->listenfd, (struct sockaddr *) NULL,
-			NULL);
-	if (sockfd < 0) {
-		if (errno != EAGAIN)
-			fprintf(stderr,
-				"iface %d: failed to accept error %d\n",
-				iface->portid, errno);
-		ret = -EAGAIN;
-	} else
-		ret = sockfd;
+	qe->data_remaining -= qe->recv_len;
+	qe->iovec_offset += qe->recv_len;
+	qe->iovec.iov_base = data + qe->recv_len;
+	qe->iovec.iov_len -= qe->recv_len;
+	if (qe->data_remaining)
+		return tcp_send_r2t(ep, qe->tag);
 
-	return ret;
+	memset(&qe->resp, 0, sizeof(qe->resp));
+	set_response(&qe->resp, qe->ccid, 0, true);
+	return tcp_send_rsp(ep, &qe->resp, qe);
 }
 
-int tcp_recv_data(struct endpoint *ep, void *buf, u64 _len)
+/*
+ * Read the payload of the current PDU. The socket is non-blocking, so
+ * this returns -EAGAIN whenever the data has not been received in full;
+ * the offset is kept in the tag and reception resumes with the next
+ * event. The PDU is handled once the last byte has arrived.
+ */
+int tcp_recv_data(struct endpoint *ep)
 {
-	int len = 0, offset = 0;
-#if 0
-	struct pollfd fds;
-
-	fds.fd = ep->sockfd;
-	fds.events = POLLIN | POLLERR;
-#endif
-	while (offset < _len) {
-#if 0
-		int ret;
-		struct pollfd fds;
+	struct ep_qe *qe = ep->recv_qe;
+	u8 *buf = qe->iovec.iov_base, *dst;
+	u64 total = qe->recv_len + tcp_ddgst_len(ep, qe->recv_len);
+	int len;
 
-		ret = poll(&fds, 1, ep->kato_interval);
-		if (ret <= 0) {
-			if (ret < 0) {
-				tcp_err(ep, "poll returned %d", errno);
-				return -errno;
-			}
-			if (--ep->kato_countdown > 0)
-				continue;
-			tcp_err(ep, "poll timeout");
-			return -ETIMEDOUT;
+	while (qe->recv_offset < total) {
+		tcp_info(ep, "read %llu bytes", total - qe->recv_offset);
+		/* The data digest trails the data */
+		if (qe->recv_offset < qe->recv_len) {
+			dst = buf + qe->recv_offset;
+			len = qe->recv_len - qe->recv_offset;
+		} else {
+			dst = (u8 *)&ep->recv_ddgst +
+				(qe->recv_offset - qe->recv_len);
+			len = total - qe->recv_offset;
 		}
-#endif
-		tcp_info(ep, "read %llu bytes",
-			_len - offset);
-		len = tcp_ep_read(ep, (u8 *)buf + offset, _len - offset);
+		len = tcp_ep_read(ep, dst, len);
 		if (len < 0) {
-			tcp_err(ep, "read returned %d", errno);
+			if (errno != EAGAIN)
+				tcp_err(ep, "read returned %d", errno);
 			return -errno;
 		}
-		offset += len;
+		if (!len) {
+			tcp_info(ep, "disconnect");
+			return -ENODATA;
+		}
+		qe->recv_offset += len;
 	}
-	return 0;
+	if (total > qe->recv_len &&
+	    le32toh(ep->recv_ddgst) != crc32c(0, buf, qe->recv_len)) {
+		tcp_err(ep, "data digest error cid %x", qe->ccid);
+		return -EBADMSG;
+	}
+
+	ep->recv_qe = NULL;
+	ep->recv_state = HANDLE_PDU;
+	if (ep->recv_pdu->common.type == nvme_tcp_h2c_data)
+		return tcp_complete_h2c_data(ep, qe);
+	return handle_command(ep, qe);
 }
 
+/*
+ * Queue the next @len bytes of the gather list of @qe as the data of
+ * a C2H PDU, without copying.
+ */
+static int tcp_send_c2h_iov(struct endpoint *ep, struct ep_qe *qe,
+			    struct nvme_tcp_data_pdu *pdu, size_t len,
+			    bool last)
+{
+	struct iovec *iov, *src;
+	size_t left, n;
+	int i, nr = 0, ret;
+
+	for (i = qe->data_iov_idx, left = len;
+	     left && i < qe->data_iovcnt; i++, nr++)
+		left -= left < qe->data_iov[i].iov_len ?
+			left : qe->data_iov[i].iov_len;
+	if (left) {
+		tcp_err(ep, "gather list short by %zu bytes", left);
+		return -EINVAL;
+	}
+	iov = malloc(nr * sizeof(struct iovec));
+	if (!iov) {
+		tcp_err(ep, "no memory for gather list");
+		return -ENOMEM;
+	}
+	for (i = 0; i < nr; i++) {
+		src = &qe->data_iov[qe->data_iov_idx];
+		n = len < src->iov_len ? len : src->iov_len;
+		iov[i].iov_base = src->iov_base;
+		iov[i].iov_len = n;
+		src->iov_base = (u8 *)src->iov_base + n;
+		src->iov_len -= n;
+		len -= n;
+		if (!src->iov_len)
+			qe->data_iov_idx++;
+	}
+	ret = tcp_queue_sendv(ep, pdu, pdu->hdr.hlen, iov, nr,
+			      last ? qe : NULL);
+	free(iov);
+	return ret;
+}
+
+/*
+ * Queue the next C2H data PDU for the current iovec of @qe. The last
+ * PDU takes over the tag, which is released once the data is sent.
+ */
 int tcp_send_c2h_data(struct endpoint *ep, struct ep_qe *qe)
 {
-	int len, send_pdu_len = 0;
 	bool last = qe->data_remaining == qe->iovec.iov_len;
 	struct nvme_tcp_data_pdu *pdu = &ep->send_pdu->data;
+	size_t data_len;
+	u8 *data;
 
 	tcp_info(ep, "c2h data cid %x offset %llu len %lu/%llu",
-		  qe->ccid, qe->data_pos, qe->iovec.iov_len,
+		  qe->ccid, qe->iovec_offset, qe->iovec.iov_len,
 		  qe->data_remaining);
 
 	if (!qe->data_remaining) {
@@ -430,56 +1238,30 @@ int tcp_send_c2h_data(struct endpoint *ep, struct ep_qe *qe)
 	pdu->hdr.hlen = sizeof(struct nvme_tcp_data_pdu);
 	pdu->hdr.plen = htole32(sizeof(struct nvme_tcp_data_pdu) +
 				qe->iovec.iov_len);
-	pdu->data_offset = htole32(qe->data_pos);
+	pdu->data_offset = htole32(qe->iovec_offset);
 	pdu->data_length = htole32(qe->iovec.iov_len);
 	pdu->command_id = qe->ccid;
 	tcp_info(ep, "c2h hdr init %u/%u bytes",
 		  pdu->hdr.hlen, pdu->hdr.plen);
 
-	while (send_pdu_len < pdu->hdr.hlen) {
-		u8 *data = (u8 *)pdu + send_pdu_len;
-		u64 data_len = pdu->hdr.hlen - send_pdu_len;
-
-		len = tcp_ep_write(ep, data, data_len);
-		if (len < 0) {
-			tcp_err(ep, "c2h hdr write returned %d", errno);
-			return -errno;
-		}
-		if (len == 0) {
-			tcp_err(ep, "c2h hdr write connection closed");
-			return -ENODATA;
-		}
-		send_pdu_len += len;
-		tcp_info(ep, "c2h hdr wrote %d bytes", len);
-	}
-	while (qe->iovec.iov_len) {
-		u8 *data = qe->iovec.iov_base;
-
-		len = tcp_ep_write(ep, data, qe->iovec.iov_len);
-		if (len < 0) {
-			tcp_err(ep, "c2h data write returned %d", errno);
-			return -errno;
-		}
-		if (len == 0) {
-			tcp_err(ep, "c2h data write connection closed");
-			return -ENODATA;
-		}
-		qe->data_remaining -= len;
-		data += len;
-		qe->iovec.iov_base = data;
-		qe->iovec.iov_len -= len;
-		qe->iovec_offset += len;
-		tcp_info(ep, "c2h data wrote %d bytes", len);
-	}
+	/* Advance first, the tag might be released once the PDU is queued */
+	data = qe->iovec.iov_base;
+	data_len = qe->iovec.iov_len;
+	qe->data_remaining -= data_len;
+	qe->iovec_offset += data_len;
+	qe->iovec.iov_base = data + data_len;
+	qe->iovec.iov_len = 0;
 
-	return 0;
+	if (qe->data_iov)
+		return tcp_send_c2h_iov(ep, qe, pdu, data_len, last);
+	return tcp_queue_send(ep, pdu, pdu->hdr.hlen, data, data_len,
+			      last ? qe : NULL);
 }
 
 int tcp_send_r2t(struct endpoint *ep, u16 tag)
 {
 	struct nvme_tcp_r2t_pdu *pdu = &ep->send_pdu->r2t;
 	struct ep_qe *qe;
-	int len;
 
 	qe = tcp_get_tag(ep, tag);
 	if (!qe) {
@@ -504,17 +1286,7 @@ int tcp_send_r2t(struct endpoint *ep, u16 tag)
 
 	memcpy(&qe->pdu, pdu, sizeof(*pdu));
 
-	len = tcp_ep_write(ep, pdu, sizeof(*pdu));
-	if (len < 0) {
-		tcp_err(ep, "r2t write returned %d", errno);
-		return -errno;
-	}
-	if (len < sizeof(*pdu)) {
-		tcp_err(ep, "short r2t write, %d bytes missing",
-			 (int)sizeof(*pdu) - len);
-		return -EAGAIN;
-	}
-	return 0;
+	return tcp_queue_send(ep, pdu, sizeof(*pdu), NULL, 0, NULL);
 }
 
 int tcp_send_c2h_term(struct endpoint *ep, u16 fes, u8 pdu_offset,
@@ -522,7 +1294,7 @@ int tcp_send_c2h_term(struct endpoint *ep, u16 fes, u8 pdu_offset,
 			     union nvme_tcp_pdu *pdu, int pdu_len)
 {
 	struct nvme_tcp_term_pdu *term_pdu = &ep->send_pdu->term;
-	int len, plen;
+	int ret, plen;
 
 	tcp_info(ep, "c2h term fes %u offset pdu %u parm %u",
 		  fes, pdu_offset, parm_offset);
@@ -540,40 +1312,25 @@ int tcp_send_c2h_term(struct endpoint *ep, u16 fes, u8 pdu_offset,
 	term_pdu->fes = htole16(fes);
 	term_pdu->fei = htole32(parm_offset << 6 | pdu_offset << 1);
 
-	len = tcp_ep_write(ep, term_pdu, sizeof(*term_pdu));
-	if (len < 0) {
-		tcp_err(ep, "c2h_term write returned %d", errno);
-		return -errno;
-	}
-	if (len != sizeof(*term_pdu)) {
-		tcp_err(ep, "c2h_term short write; %d bytes missing",
-			 plen - len);
-		return -EAGAIN;
-	}
-	if (pdu) {
-		len = tcp_ep_write(ep, pdu, pdu_len);
-		if (len < 0) {
-			tcp_err(ep, "c2h term pdu write returned %d", errno);
-			return -errno;
-		}
-		if (len != pdu_len) {
-			tcp_err(ep, "c2h term short write; %d bytes missing",
-				 pdu_len - len);
-			return -EAGAIN;
-		}
+	ret = tcp_queue_send(ep, term_pdu, sizeof(*term_pdu),
+			     pdu, pdu_len, NULL);
+	if (ret < 0) {
+		tcp_err(ep, "c2h_term write returned %d", ret);
+		return ret;
 	}
-
 	ep->recv_state = RECV_PDU;
-	ep->recv_pdu_len = 0;
 
 	/* Return -EPROTO to signal the connection should be dropped */
 	return -EPROTO;
 }
 
-int tcp_send_rsp(struct endpoint *ep, struct nvme_completion *comp)
+/*
+ * Queue a response capsule; @qe, if set, is released once it is sent.
+ */
+int tcp_send_rsp(struct endpoint *ep, struct nvme_completion *comp,
+		 struct ep_qe *qe)
 {
 	struct nvme_tcp_rsp_pdu *pdu = &ep->send_pdu->rsp;
-	int len;
 
 	tcp_info(ep, "rsp tag %#x status %04x",
 		  comp->command_id, comp->status);
@@ -587,13 +1344,7 @@ int tcp_send_rsp(struct endpoint *ep, struct nvme_completion *comp)
 	memcpy(&(pdu->cqe), comp, sizeof(struct nvme_completion));
 
 	tcp_info(ep, "write %u pdu bytes", pdu->hdr.plen);
-	len = tcp_ep_write(ep, pdu, pdu->hdr.plen);
-	if (len != sizeof(*pdu)) {
-		tcp_err(ep, "tcp_ep_write returned %d", errno);
-		return -errno;
-	}
-
-	return 0;
+	return tcp_queue_send(ep, pdu, pdu->hdr.plen, NULL, 0, qe);
 }
 
 int tcp_handle_h2c_data(struct endpoint *ep, union nvme_tcp_pdu *pdu)
@@ -601,9 +1352,7 @@ int tcp_handle_h2c_data(struct endpoint *ep, union nvme_tcp_pdu *pdu)
 	u16 ttag = le16toh(pdu->data.ttag);
 	u32 data_offset = le32toh(pdu->data.data_offset);
 	u32 data_len = le32toh(pdu->data.data_length);
-	u8 *data;
 	struct ep_qe *qe;
-	int ret;
 
 	tcp_info(ep, "h2c data tag %#x pos %u len %u",
 		  ttag, data_offset, data_len);
@@ -621,6 +1370,13 @@ int tcp_handle_h2c_data(struct endpoint *ep, union nvme_tcp_pdu *pdu)
 				offsetof(struct nvme_tcp_data_pdu, data_offset),
 				0, false, pdu, sizeof(struct nvme_tcp_data_pdu));
 	}
+	if (data_len > ep->maxh2cdata) {
+		tcp_err(ep, "h2c len %u exceeds maxh2cdata %d",
+			data_len, ep->maxh2cdata);
+		return tcp_send_c2h_term(ep, NVME_TCP_FES_DATA_LIMIT_EXCEEDED,
+				offsetof(struct nvme_tcp_data_pdu, data_length),
+				0, false, pdu, sizeof(struct nvme_tcp_data_pdu));
+	}
 	if (data_len > qe->iovec.iov_len) {
 		tcp_err(ep, "h2c len overflow, is %u exp %llu",
 			 data_len, qe->data_remaining);
@@ -629,88 +1385,47 @@ int tcp_handle_h2c_data(struct endpoint *ep, union nvme_tcp_pdu *pdu)
 				0, false, pdu, sizeof(struct nvme_tcp_data_pdu));
 	}
 
-	ret = tcp_recv_data(ep, qe->iovec.iov_base, qe->iovec.iov_len);
-	if (ret < 0) {
-		tcp_err(ep, "h2c data read failed, error %d", errno);
-		ret = NVME_SC_SGL_INVALID_DATA;
-		goto out_rsp;
-	}
-	qe->data_remaining -= ret;
-	qe->iovec_offset += ret;
-	data = qe->iovec.iov_base;
-	data += ret;
-	qe->iovec.iov_base = data;
-	qe->iovec.iov_len -= ret;
-	if (!qe->data_remaining) {
-		ret = 0;
-		goto out_rsp;
-	}
-
-	return tcp_send_r2t(ep, qe->tag);
-out_rsp:
-	memset(&qe->resp, 0, sizeof(qe->resp));
-	set_response(&qe->resp, qe->ccid, ret, true);
-	return tcp_send_rsp(ep, &qe->resp);
+	tcp_start_recv_data(ep, qe, data_len);
+	return 0;
 }
 
+/*
+ * Pick up the next PDU header from the receive buffer. The PDU is
+ * handled in place; -EAGAIN is returned until the header is complete.
+ */
 int tcp_read_msg(struct endpoint *ep)
 {
-	u8 *msg = (u8 *)ep->recv_pdu + ep->recv_pdu_len;
-	int len, msg_len;
-
-	if (ep->recv_pdu_len < sizeof(struct nvme_tcp_hdr)) {
-		msg_len = sizeof(struct nvme_tcp_hdr) - ep->recv_pdu_len;
-		tcp_info(ep, "read %u msg bytes", msg_len);
-		len = tcp_ep_read(ep, msg, msg_len);
-		if (len < 0) {
-			tcp_err(ep, "failed to read msg hdr, error %d",
-				errno);
-			return -errno;
-		}
-		/* No data received, disconnected */
-		if (!len) {
-			tcp_info(ep, "disconnect");
-			return -ENODATA;
-		}
+	union nvme_tcp_pdu *pdu = tcp_rx_peek(ep);
+	struct nvme_tcp_hdr *hdr;
+	u32 crc;
+	int hdgst;
 
-		ep->recv_pdu_len += len;
-		msg_len -= len;
-		if (msg_len) {
-			tcp_err(ep, "short msg hdr read, %lu bytes missing",
-				sizeof(struct nvme_tcp_hdr) - ep->recv_pdu_len);
-			return -EAGAIN;
-		}
-	}
-	if (!ep->recv_pdu->common.hlen) {
+	if (!pdu)
+		return -EAGAIN;
+	hdr = &pdu->common;
+	if (hdr->hlen < sizeof(struct nvme_tcp_hdr) ||
+	    hdr->hlen > sizeof(union nvme_tcp_pdu)) {
 		tcp_err(ep, "corrupt hdr, hlen %d size %ld",
-			ep->recv_pdu->common.hlen,
-			sizeof(struct nvme_tcp_hdr));
+			hdr->hlen, sizeof(struct nvme_tcp_hdr));
 		return tcp_send_c2h_term(ep, NVME_TCP_FES_INVALID_PDU_HDR,
 					offsetof(struct nvme_tcp_hdr, hlen),
 					0, false, NULL, 0);
 	}
-	msg_len = ep->recv_pdu->common.hlen - ep->recv_pdu_len;
-	if (msg_len) {
-		msg = (u8 *)ep->recv_pdu + ep->recv_pdu_len;
-
-		tcp_info(ep, "read %u pdu bytes", msg_len);
-		len = tcp_ep_read(ep, msg, msg_len);
-		if (len == 0)
-			return -EAGAIN;
-		if (len < 0) {
-			tcp_err(ep, "failed to read msg payload error %d",
-				errno);
-			return -errno;
+	hdgst = tcp_hdgst_len(ep, hdr->type);
+	if (hdgst) {
+		memcpy(&crc, (u8 *)pdu + hdr->hlen, hdgst);
+		if (le32toh(crc) != crc32c(0, pdu, hdr->hlen)) {
+			tcp_err(ep, "header digest error, pdu type %d",
+				hdr->type);
+			return tcp_send_c2h_term(ep, NVME_TCP_FES_HDR_DIGEST_ERR,
+						 0, 0, true, pdu, hdr->hlen);
 		}
-		ep->recv_pdu_len += len;
-		msg_len -= len;
-		if (msg_len > 0) {
-			tcp_err(ep, "short msg payload read, %u bytes missing",
-			       msg_len);
-			return -EAGAIN;
-		}
-		ep->recv_state = HANDLE_PDU;
 	}
+	tcp_info(ep, "pdu type %d hlen %u plen %u",
+		 hdr->type, hdr->hlen, le32toh(hdr->plen));
+	ep->recv_pdu = pdu;
+	ep->rx_head += hdr->hlen + hdgst;
+	ep->recv_state = HANDLE_PDU;
 	return 0;
 }
 
@@ -724,7 +1439,6 @@ int tcp_handle_msg(struct endpoint *ep)
 
 	if (hdr->type == nvme_tcp_h2c_term) {
 		ep->recv_state = RECV_PDU;
-		ep->recv_pdu_len = 0;
 		tcp_info(ep, "h2c term, disconnecting");
 		return -ENOTCONN;
 	}
@@ -746,19 +1460,24 @@ int tcp_send_data(struct endpoint *ep, struct ep_qe *qe, u64 data_len)
 
 	qe->data_remaining = data_len;
 	qe->iovec.iov_base = qe->data;
-	qe->iovec.iov_len = (ep->mdts && data_len > ep->mdts) ?
-		ep->mdts : data_len;
+	qe->iovec.iov_len = data_len > ep->maxc2hdata ?
+		ep->maxc2hdata : data_len;
 	qe->iovec_offset = 0;
+	if (!data_len) {
+		tcp_release_tag(ep, qe);
+		return 0;
+	}
+	/*
+	 * The tag is released with the last PDU; on error it is kept as
+	 * queued PDUs might still refer to its data.
+	 */
 	while (qe->data_remaining) {
 		int ret = tcp_send_c2h_data(ep, qe);
-		if (ret < 0) {
-			tcp_release_tag(ep, qe);
+		if (ret < 0)
 			return ret;
-		}
 		data_len = qe->data_remaining;
-		qe->iovec.iov_len = (ep->mdts && data_len > ep->mdts) ?
-			ep->mdts : data_len;
+		qe->iovec.iov_len = data_len > ep->maxc2hdata ?
+			ep->maxc2hdata : data_len;
 	}
-	tcp_release_tag(ep, qe);
 	return 0;
 }
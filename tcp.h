@@ -2,23 +2,36 @@
 #define _NVMET_TCP_H
 
 int tcp_create_endpoint(struct endpoint *ep, int id);
+int tcp_alloc_buffers(struct endpoint *ep);
 void tcp_destroy_endpoint(struct endpoint *ep);
+int tcp_alloc_tags(struct endpoint *ep, int qsize);
+int tcp_resize_tags(struct endpoint *ep, int qsize, struct ep_qe **qe);
 struct ep_qe *tcp_acquire_tag(struct endpoint *ep, union nvme_tcp_pdu *pdu,
 			      u16 ccid, u64 pos, u64 len);
 struct ep_qe *tcp_get_tag(struct endpoint *ep, u16 tag);
 void tcp_release_tag(struct endpoint *ep, struct ep_qe *qe);
+int tcp_send_iov(struct endpoint *ep, struct iovec *iov, int max_iov,
+		 bool *more);
+void tcp_send_complete(struct endpoint *ep, size_t len);
+int tcp_zc_complete(struct endpoint *ep);
+int tcp_send_flush(struct endpoint *ep);
 int tcp_init_listener(struct interface *iface);
 void tcp_destroy_listener(struct interface *iface);
 int tcp_accept_connection(struct endpoint *ep);
-int tcp_wait_for_connection(struct interface *iface, int timeout_ms);
-int tcp_recv_data(struct endpoint *ep, void *buf, u64 _len);
+int tcp_wait_for_connection(struct interface *iface, int *fds, int max_fds,
+			    int timeout_ms);
+int tcp_accept(struct interface *iface, int listenfd);
+int tcp_recv_incapsule_data(struct endpoint *ep, struct ep_qe *qe);
+int tcp_recv_data(struct endpoint *ep);
 int tcp_send_c2h_data(struct endpoint *ep, struct ep_qe *qe);
 int tcp_send_r2t(struct endpoint *ep, u16 tag);
 int tcp_send_c2h_term(struct endpoint *ep, u16 fes, u8 pdu_offset,
 		      u8 parm_offset, bool hdr_digest,
 		      union nvme_tcp_pdu *pdu, int pdu_len);
-int tcp_send_rsp(struct endpoint *ep, struct nvme_completion *comp);
+int tcp_send_rsp(struct endpoint *ep, struct nvme_completion *comp,
+		 struct ep_qe *qe);
 int tcp_handle_h2c_data(struct endpoint *ep, union nvme_tcp_pdu *pdu);
+int tcp_rx_fill(struct endpoint *ep);
 int tcp_read_msg(struct endpoint *ep);
 int tcp_handle_msg(struct endpoint *ep);
 int tcp_send_data(struct endpoint *ep, struct ep_qe *qe, u64 data_len);
@@ -0,0 +1,414 @@
+/*
+ * tls.c
+ * TLS 1.3 PSK termination for NVMe/TCP connections
+ *
+ * The handshake runs in userspace with GnuTLS on the non-blocking
+ * socket. Once it completes the session keys are handed to kernel TLS,
+ * so the data path keeps using plain read() and sendmsg() on the
+ * socket. If the kernel does not provide kTLS the records are
+ * processed by GnuTLS instead.
+ */
+#include <stdio.h>
+#include <stdbool.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <linux/tls.h>
+#include <gnutls/gnutls.h>
+
+#include "common.h"
+#include "tls.h"
+
+#ifndef SOL_TLS
+#define SOL_TLS			282
+#endif
+
+/* NVMe/TCP mandates TLS_AES_128_GCM_SHA256, kTLS handles both */
+#define TLS_PRIORITY	"NORMAL:-VERS-ALL:+VERS-TLS1.3:-KX-ALL:" \
+			"+ECDHE-PSK:+DHE-PSK:+PSK:" \
+			"-CIPHER-ALL:+AES-128-GCM:+AES-256-GCM"
+
+#define TLS_KEY_PREFIX	"NVMeTLSkey-1:"
+#define TLS_RECORD_HANDSHAKE	0x16
+
+#define tls_info(e, f, x...)					\
+	if (tcp_debug) {					\
+		printf("ep %d: " f "\n",			\
+		       (e)->sockfd, ##x);			\
+		fflush(stdout);					\
+	}
+
+#define tls_err(e, f, x...)					\
+	do {							\
+		fprintf(stderr, "ep %d: " f "\n",		\
+			(e)->sockfd, ##x);			\
+		fflush(stderr);					\
+	} while (0)
+
+static gnutls_psk_server_credentials_t tls_psk_cred;
+static gnutls_priority_t tls_priority;
+
+/* CRC-32 (IEEE) protecting the key in the PSK interchange format */
+static u32 tls_key_crc(const unsigned char *buf, size_t len)
+{
+	u32 crc = ~0;
+	int i;
+
+	while (len--) {
+		crc ^= *buf++;
+		for (i = 0; i < 8; i++)
+			crc = (crc >> 1) ^ (crc & 1 ? 0xedb88320 : 0);
+	}
+	return ~crc;
+}
+
+/*
+ * Read a configured PSK in the NVMe TLS PSK interchange format,
+ * 'NVMeTLSkey-1:<hash>:<base64 of key and crc>:'.
+ */
+static int tls_read_key(struct etcd_cdc_ctx *ctx)
+{
+	char buf[256], *b64, *end;
+	gnutls_datum_t in, out;
+	unsigned int hash;
+	u32 crc;
+	int fd, len, ret;
+
+	fd = open(ctx->tls_keyfile, O_RDONLY);
+	if (fd < 0) {
+		fprintf(stderr, "tls: cannot open key file %s, error %d\n",
+			ctx->tls_keyfile, errno);
+		return -errno;
+	}
+	len = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (len < 0)
+		return -errno;
+	buf[len] = '\0';
+
+	if (strncmp(buf, TLS_KEY_PREFIX, strlen(TLS_KEY_PREFIX)) ||
+	    sscanf(buf + strlen(TLS_KEY_PREFIX), "%02x:", &hash) != 1) {
+		fprintf(stderr, "tls: invalid key format\n");
+		return -EINVAL;
+	}
+	if (hash != 0) {
+		fprintf(stderr, "tls: unsupported PSK hash %02x\n", hash);
+		return -EINVAL;
+	}
+	b64 = buf + strlen(TLS_KEY_PREFIX) + 3;
+	end = strchr(b64, ':');
+	if (!end) {
+		fprintf(stderr, "tls: invalid key format\n");
+		return -EINVAL;
+	}
+	in.data = (unsigned char *)b64;
+	in.size = end - b64;
+	ret = gnutls_base64_decode2(&in, &out);
+	if (ret < 0) {
+		fprintf(stderr, "tls: invalid key encoding, %s\n",
+			gnutls_strerror(ret));
+		return -EINVAL;
+	}
+	if (out.size != 32 + 4 && out.size != 48 + 4) {
+		fprintf(stderr, "tls: invalid key length %u\n", out.size - 4);
+		gnutls_free(out.data);
+		return -EINVAL;
+	}
+	memcpy(&crc, out.data + out.size - 4, sizeof(crc));
+	if (le32toh(crc) != tls_key_crc(out.data, out.size - 4)) {
+		fprintf(stderr, "tls: key checksum mismatch\n");
+		gnutls_free(out.data);
+		return -EINVAL;
+	}
+	ctx->tls_key_len = out.size - 4;
+	ctx->tls_key = malloc(ctx->tls_key_len);
+	if (ctx->tls_key)
+		memcpy(ctx->tls_key, out.data, ctx->tls_key_len);
+	gnutls_free(out.data);
+	return ctx->tls_key ? 0 : -ENOMEM;
+}
+
+/*
+ * Every host presenting the configured PSK is accepted; the identity
+ * is only logged.
+ */
+static int tls_psk_lookup(gnutls_session_t session, const char *identity,
+			  gnutls_datum_t *key)
+{
+	struct endpoint *ep = gnutls_session_get_ptr(session);
+	struct interface *iface = ep->iface;
+
+	tls_info(ep, "PSK identity '%s'", identity);
+	key->data = gnutls_malloc(iface->tls_key_len);
+	if (!key->data)
+		return -1;
+	memcpy(key->data, iface->tls_key, iface->tls_key_len);
+	key->size = iface->tls_key_len;
+	return 0;
+}
+
+int tls_init(struct etcd_cdc_ctx *ctx)
+{
+	int ret;
+
+	if (!ctx->tls)
+		return 0;
+	if (!ctx->tls_keyfile) {
+		fprintf(stderr, "tls: no PSK configured\n");
+		return -EINVAL;
+	}
+	ret = tls_read_key(ctx);
+	if (ret < 0)
+		return ret;
+
+	ret = gnutls_global_init();
+	if (ret < 0)
+		goto out_err;
+	ret = gnutls_psk_allocate_server_credentials(&tls_psk_cred);
+	if (ret < 0)
+		goto out_deinit;
+	gnutls_psk_set_server_credentials_function(tls_psk_cred,
+						   tls_psk_lookup);
+	ret = gnutls_priority_init(&tls_priority, TLS_PRIORITY, NULL);
+	if (ret < 0)
+		goto out_free_cred;
+	printf("TLS 1.3 enabled, %zu byte PSK\n", ctx->tls_key_len);
+	return 0;
+
+out_free_cred:
+	gnutls_psk_free_server_credentials(tls_psk_cred);
+out_deinit:
+	gnutls_global_deinit();
+out_err:
+	fprintf(stderr, "tls: setup failed, %s\n", gnutls_strerror(ret));
+	free(ctx->tls_key);
+	ctx->tls_key = NULL;
+	return -EINVAL;
+}
+
+void tls_exit(struct etcd_cdc_ctx *ctx)
+{
+	if (!ctx->tls_key)
+		return;
+	gnutls_priority_deinit(tls_priority);
+	gnutls_psk_free_server_credentials(tls_psk_cred);
+	gnutls_global_deinit();
+	memset(ctx->tls_key, 0, ctx->tls_key_len);
+	free(ctx->tls_key);
+	ctx->tls_key = NULL;
+}
+
+/*
+ * Check whether the host starts with a TLS handshake and set up the
+ * session if so. Returns 1 for a TLS connection, 0 for plaintext.
+ * The first byte is only peeked at, so a plaintext ICReq is left
+ * in the socket.
+ */
+int tls_accept(struct endpoint *ep)
+{
+	gnutls_session_t session;
+	u8 type;
+	int ret;
+
+	ret = recv(ep->sockfd, &type, 1, MSG_PEEK);
+	if (ret < 0)
+		return -errno;
+	if (!ret)
+		return -ENODATA;
+	if (type != TLS_RECORD_HANDSHAKE)
+		return 0;
+
+	ret = gnutls_init(&session, GNUTLS_SERVER | GNUTLS_NONBLOCK |
+			  GNUTLS_NO_TICKETS);
+	if (ret < 0) {
+		tls_err(ep, "TLS session setup failed, %s",
+			gnutls_strerror(ret));
+		return -ENOMEM;
+	}
+	gnutls_priority_set(session, tls_priority);
+	gnutls_credentials_set(session, GNUTLS_CRD_PSK, tls_psk_cred);
+	gnutls_session_set_ptr(session, ep);
+	/*
+	 * GnuTLS reads the socket record by record without reading
+	 * ahead, so nothing beyond the handshake is consumed and the
+	 * kernel can take over right after it.
+	 */
+	gnutls_transport_set_int(session, ep->sockfd);
+	ep->tls_session = session;
+	return 1;
+}
+
+static int tls_set_crypto(struct endpoint *ep, int optname)
+{
+	union {
+		struct tls12_crypto_info_aes_gcm_128 gcm128;
+		struct tls12_crypto_info_aes_gcm_256 gcm256;
+	} info;
+	gnutls_datum_t mac, iv, key;
+	unsigned char seq[8];
+	socklen_t len;
+	int ret;
+
+	ret = gnutls_record_get_state(ep->tls_session, optname == TLS_RX,
+				      &mac, &iv, &key, seq);
+	if (ret < 0) {
+		tls_err(ep, "failed to get TLS state, %s",
+			gnutls_strerror(ret));
+		return -EINVAL;
+	}
+	memset(&info, 0, sizeof(info));
+	switch (gnutls_cipher_get(ep->tls_session)) {
+	case GNUTLS_CIPHER_AES_128_GCM:
+		info.gcm128.info.version = TLS_1_3_VERSION;
+		info.gcm128.info.cipher_type = TLS_CIPHER_AES_GCM_128;
+		memcpy(info.gcm128.key, key.data,
+		       TLS_CIPHER_AES_GCM_128_KEY_SIZE);
+		memcpy(info.gcm128.salt, iv.data,
+		       TLS_CIPHER_AES_GCM_128_SALT_SIZE);
+		memcpy(info.gcm128.iv,
+		       iv.data + TLS_CIPHER_AES_GCM_128_SALT_SIZE,
+		       TLS_CIPHER_AES_GCM_128_IV_SIZE);
+		memcpy(info.gcm128.rec_seq, seq,
+		       TLS_CIPHER_AES_GCM_128_REC_SEQ_SIZE);
+		len = sizeof(info.gcm128);
+		break;
+	case GNUTLS_CIPHER_AES_256_GCM:
+		info.gcm256.info.version = TLS_1_3_VERSION;
+		info.gcm256.info.cipher_type = TLS_CIPHER_AES_GCM_256;
+		memcpy(info.gcm256.key, key.data,
+		       TLS_CIPHER_AES_GCM_256_KEY_SIZE);
+		memcpy(info.gcm256.salt, iv.data,
+		       TLS_CIPHER_AES_GCM_256_SALT_SIZE);
+		memcpy(info.gcm256.iv,
+		       iv.data + TLS_CIPHER_AES_GCM_256_SALT_SIZE,
+		       TLS_CIPHER_AES_GCM_256_IV_SIZE);
+		memcpy(info.gcm256.rec_seq, seq,
+		       TLS_CIPHER_AES_GCM_256_REC_SEQ_SIZE);
+		len = sizeof(info.gcm256);
+		break;
+	default:
+		return -EOPNOTSUPP;
+	}
+	ret = setsockopt(ep->sockfd, SOL_TLS, optname, &info, len);
+	memset(&info, 0, sizeof(info));
+	if (ret < 0)
+		return -errno;
+	return 0;
+}
+
+/*
+ * Hand the session over to kernel TLS. Falling back to userspace is
+ * only possible as long as the transmit side has not been switched.
+ */
+static int tls_offload(struct endpoint *ep)
+{
+	int ret;
+
+	if (gnutls_record_check_pending(ep->tls_session))
+		return -EAGAIN;
+	if (setsockopt(ep->sockfd, IPPROTO_TCP, TCP_ULP,
+		       "tls", sizeof("tls")) < 0)
+		return -errno;
+	ret = tls_set_crypto(ep, TLS_TX);
+	if (ret < 0)
+		return ret;
+	ret = tls_set_crypto(ep, TLS_RX);
+	if (ret < 0) {
+		tls_err(ep, "failed to set kTLS receive keys, error %d", -ret);
+		return -EPROTO;
+	}
+	ep->tls_ktls = true;
+	return 0;
+}
+
+/*
+ * Continue the handshake; returns -EAGAIN until it is complete.
+ */
+int tls_handshake(struct endpoint *ep)
+{
+	int ret;
+
+	ret = gnutls_handshake(ep->tls_session);
+	if (ret == GNUTLS_E_AGAIN || ret == GNUTLS_E_INTERRUPTED) {
+		/*
+		 * The handshake flights are a few hundred bytes on a fresh
+		 * socket; a full send buffer means the host is not reading.
+		 */
+		if (gnutls_record_get_direction(ep->tls_session)) {
+			tls_err(ep, "TLS handshake stalled on send");
+			return -ENOBUFS;
+		}
+		return -EAGAIN;
+	}
+	if (ret < 0) {
+		tls_err(ep, "TLS handshake failed, %s", gnutls_strerror(ret));
+		return -EPROTO;
+	}
+
+	ret = tls_offload(ep);
+	if (ret == -EPROTO)
+		return ret;
+	tls_info(ep, "TLS 1.3 %s established%s",
+		 gnutls_cipher_get_name(gnutls_cipher_get(ep->tls_session)),
+		 ep->tls_ktls ? " with kTLS" : "");
+	if (ret < 0)
+		tls_info(ep, "kTLS not available, error %d", -ret);
+	return 0;
+}
+
+/*
+ * Userspace record processing if kTLS is not available; these follow
+ * the read() and send() conventions.
+ */
+ssize_t tls_recv(struct endpoint *ep, void *buf, size_t len)
+{
+	ssize_t ret;
+
+	ret = gnutls_record_recv(ep->tls_session, buf, len);
+	if (ret >= 0)
+		return ret;
+	if (ret == GNUTLS_E_AGAIN || ret == GNUTLS_E_INTERRUPTED)
+		errno = EAGAIN;
+	else if (ret == GNUTLS_E_PREMATURE_TERMINATION)
+		return 0;
+	else {
+		tls_err(ep, "TLS receive failed, %s", gnutls_strerror(ret));
+		errno = EIO;
+	}
+	return -1;
+}
+
+ssize_t tls_send(struct endpoint *ep, const void *buf, size_t len)
+{
+	ssize_t ret;
+
+	/* After E_AGAIN GnuTLS expects the same buffer to be resent */
+	ret = gnutls_record_send(ep->tls_session, buf, len);
+	if (ret >= 0)
+		return ret;
+	if (ret == GNUTLS_E_AGAIN || ret == GNUTLS_E_INTERRUPTED)
+		errno = EAGAIN;
+	else {
+		tls_err(ep, "TLS send failed, %s", gnutls_strerror(ret));
+		errno = EIO;
+	}
+	return -1;
+}
+
+/* Decrypted data buffered in userspace which epoll doesn't know about */
+bool tls_pending(struct endpoint *ep)
+{
+	if (!ep->tls_session || ep->tls_ktls)
+		return false;
+	return gnutls_record_check_pending(ep->tls_session) > 0;
+}
+
+void tls_free(struct endpoint *ep)
+{
+	if (!ep->tls_session)
+		return;
+	gnutls_deinit(ep->tls_session);
+	ep->tls_session = NULL;
+	ep->tls_ktls = false;
+}
@@ -0,0 +1,13 @@
+#ifndef _NVMET_TLS_H
+#define _NVMET_TLS_H
+
+int tls_init(struct etcd_cdc_ctx *ctx);
+void tls_exit(struct etcd_cdc_ctx *ctx);
+int tls_accept(struct endpoint *ep);
+int tls_handshake(struct endpoint *ep);
+ssize_t tls_recv(struct endpoint *ep, void *buf, size_t len);
+ssize_t tls_send(struct endpoint *ep, const void *buf, size_t len);
+bool tls_pending(struct endpoint *ep);
+void tls_free(struct endpoint *ep);
+
+#endif /* _NVMET_TLS_H */
@@ -0,0 +1,335 @@
+/*
+ * topology.c
+ * Published snapshots of the discovery topology.
+ *
+ * The inotify thread is the only writer of the discovery database.
+ * After each batch of changes it builds a new snapshot and publishes
+ * it here, so that command processing never has to go through sqlite.
+ *
+ * A snapshot holds the discovery log entry of every subsystem/port
+ * link exactly once, formatted when the snapshot is built. Each host
+ * has a preformatted log page header and a list of pointers to the
+ * entries it may see, so a log page can be sent as a gather list
+ * straight out of the snapshot. Host pages which did not change are
+ * shared with the previous snapshot (see logcache.c), and keep the
+ * entries they point to alive by holding a reference on their set.
+ *
+ * Readers pin the current snapshot without taking any locks: they
+ * register with the reader counter for the current epoch and then
+ * load the snapshot pointer. The writer swaps the pointer, and waits
+ * for the reader counters of both epochs to drain before it drops
+ * its reference to the old snapshot. Any reader which registers
+ * after the counter it belongs to has drained is guaranteed to see
+ * the new snapshot. Readers which need the snapshot for longer, like
+ * until a log page has been sent, take a reference while pinned.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "topology.h"
+
+static struct topo_snapshot *topology_current;
+static unsigned long topology_version;
+static unsigned long topology_epoch;
+static long topology_readers[2];
+
+/*
+ * Every log page read is served from the snapshot, and the database
+ * is only queried when a snapshot is built, so these take the place
+ * of cache hit and miss counters.
+ */
+static struct {
+	unsigned long reads;
+	unsigned long unknown_reads;
+} topology_stats;
+
+struct topo_snapshot *topology_pin(int *idx)
+{
+	*idx = __atomic_load_n(&topology_epoch, __ATOMIC_SEQ_CST) & 1;
+	__atomic_add_fetch(&topology_readers[*idx], 1, __ATOMIC_SEQ_CST);
+	return __atomic_load_n(&topology_current, __ATOMIC_SEQ_CST);
+}
+
+void topology_unpin(int idx)
+{
+	__atomic_sub_fetch(&topology_readers[idx], 1, __ATOMIC_RELEASE);
+}
+
+/* Only valid while the snapshot is pinned or already referenced */
+void topology_get(struct topo_snapshot *snap)
+{
+	__atomic_add_fetch(&snap->refs, 1, __ATOMIC_RELAXED);
+}
+
+void topology_put(struct topo_snapshot *snap)
+{
+	if (!__atomic_sub_fetch(&snap->refs, 1, __ATOMIC_ACQ_REL))
+		topology_free(snap);
+}
+
+static int topology_cmp_host(const void *a, const void *b)
+{
+	const struct topo_host *ha = *(struct topo_host **)a;
+	const struct topo_host *hb = *(struct topo_host **)b;
+
+	/* NQN lookups in discdb use LIKE, which ignores ASCII case */
+	return strcasecmp(ha->nqn, hb->nqn);
+}
+
+struct topo_host *topology_find_host(struct topo_snapshot *snap,
+				     const char *hostnqn)
+{
+	struct topo_host key = {
+		.nqn = (char *)hostnqn,
+	}, *keyp = &key, **host;
+
+	if (!snap || !snap->nr_hosts)
+		return NULL;
+	host = bsearch(&keyp, snap->hosts, snap->nr_hosts,
+		       sizeof(struct topo_host *), topology_cmp_host);
+	return host ? *host : NULL;
+}
+
+/*
+ * Log page of @hostnqn, or of hosts not in the database. Accounted
+ * in the read statistics.
+ */
+struct topo_host *topology_host_page(struct topo_snapshot *snap,
+				     const char *hostnqn)
+{
+	struct topo_host *host = topology_find_host(snap, hostnqn);
+
+	__atomic_add_fetch(&topology_stats.reads, 1, __ATOMIC_RELAXED);
+	if (host)
+		return host;
+	__atomic_add_fetch(&topology_stats.unknown_reads, 1,
+			   __ATOMIC_RELAXED);
+	return &snap->unknown;
+}
+
+static int topology_cmp_entry(const void *a, const void *b)
+{
+	const struct topo_entry *ea = a, *eb = b;
+
+	if (ea->subsys_id != eb->subsys_id)
+		return ea->subsys_id < eb->subsys_id ? -1 : 1;
+	if (ea->port_id != eb->port_id)
+		return ea->port_id < eb->port_id ? -1 : 1;
+	return 0;
+}
+
+struct topo_entry *topology_find_entry(struct topo_snapshot *snap,
+				       int subsys_id, int port_id)
+{
+	struct topo_entry key = {
+		.subsys_id = subsys_id,
+		.port_id = port_id,
+	};
+
+	if (!snap->set->nr_entries)
+		return NULL;
+	return bsearch(&key, snap->set->entries, snap->set->nr_entries,
+		       sizeof(struct topo_entry), topology_cmp_entry);
+}
+
+static void topology_put_set(struct topo_entry_set *set)
+{
+	if (__atomic_sub_fetch(&set->refs, 1, __ATOMIC_ACQ_REL))
+		return;
+	free(set->entries);
+	free(set);
+}
+
+static int topology_init_host(struct topo_snapshot *snap,
+			      struct topo_host *host)
+{
+	host->hdr = malloc(sizeof(struct nvmf_disc_rsp_page_hdr));
+	if (!host->hdr)
+		return -ENOMEM;
+	memset(host->hdr, 0, sizeof(struct nvmf_disc_rsp_page_hdr));
+	host->hdr->recfmt = 1;
+	host->refs = 1;
+	host->set = snap->set;
+	__atomic_add_fetch(&snap->set->refs, 1, __ATOMIC_RELAXED);
+	return 0;
+}
+
+static void topology_free_host(struct topo_host *host)
+{
+	free(host->nqn);
+	free(host->hdr);
+	free(host->entries);
+	if (host->set)
+		topology_put_set(host->set);
+}
+
+struct topo_snapshot *topology_alloc(void)
+{
+	struct topo_snapshot *snap;
+
+	snap = malloc(sizeof(*snap));
+	if (!snap)
+		return NULL;
+	memset(snap, 0, sizeof(*snap));
+	snap->refs = 1;
+	snap->set = malloc(sizeof(*snap->set));
+	if (!snap->set) {
+		free(snap);
+		return NULL;
+	}
+	memset(snap->set, 0, sizeof(*snap->set));
+	snap->set->refs = 1;
+	if (topology_init_host(snap, &snap->unknown) < 0) {
+		free(snap->set);
+		free(snap);
+		return NULL;
+	}
+	return snap;
+}
+
+/* Empty log page of @hostnqn pointing into the entries of @snap */
+struct topo_host *topology_alloc_host(struct topo_snapshot *snap,
+				      const char *hostnqn)
+{
+	struct topo_host *host;
+
+	host = malloc(sizeof(*host));
+	if (!host)
+		return NULL;
+	memset(host, 0, sizeof(*host));
+	host->nqn = strdup(hostnqn);
+	if (!host->nqn) {
+		free(host);
+		return NULL;
+	}
+	if (topology_init_host(snap, host) < 0) {
+		free(host->nqn);
+		free(host);
+		return NULL;
+	}
+	return host;
+}
+
+/* Takes over the reference to @host */
+int topology_add_host(struct topo_snapshot *snap, struct topo_host *host)
+{
+	struct topo_host **hosts;
+
+	hosts = realloc(snap->hosts,
+			(snap->nr_hosts + 1) * sizeof(struct topo_host *));
+	if (!hosts)
+		return -ENOMEM;
+	snap->hosts = hosts;
+	snap->hosts[snap->nr_hosts++] = host;
+	return 0;
+}
+
+/* Only valid while holding a reference to a snapshot containing @host */
+void topology_get_host(struct topo_host *host)
+{
+	__atomic_add_fetch(&host->refs, 1, __ATOMIC_RELAXED);
+}
+
+void topology_put_host(struct topo_host *host)
+{
+	if (__atomic_sub_fetch(&host->refs, 1, __ATOMIC_ACQ_REL))
+		return;
+	topology_free_host(host);
+	free(host);
+}
+
+void topology_sort_hosts(struct topo_snapshot *snap)
+{
+	qsort(snap->hosts, snap->nr_hosts, sizeof(struct topo_host *),
+	      topology_cmp_host);
+}
+
+void topology_sort_entries(struct topo_snapshot *snap)
+{
+	qsort(snap->set->entries, snap->set->nr_entries,
+	      sizeof(struct topo_entry), topology_cmp_entry);
+}
+
+void topology_free(struct topo_snapshot *snap)
+{
+	int i;
+
+	if (!snap)
+		return;
+	for (i = 0; i < snap->nr_hosts; i++)
+		topology_put_host(snap->hosts[i]);
+	topology_free_host(&snap->unknown);
+	topology_put_set(snap->set);
+	free(snap->hosts);
+	free(snap);
+}
+
+/*
+ * Wait until no reader can still hold a snapshot which was
+ * replaced before this call.
+ */
+static void topology_synchronize(void)
+{
+	unsigned long epoch;
+	int i;
+
+	for (i = 0; i < 2; i++) {
+		epoch = __atomic_fetch_add(&topology_epoch, 1,
+					   __ATOMIC_SEQ_CST);
+		while (__atomic_load_n(&topology_readers[epoch & 1],
+				       __ATOMIC_ACQUIRE))
+			usleep(10);
+	}
+}
+
+void topology_publish(struct topo_snapshot *snap)
+{
+	struct topo_snapshot *old;
+
+	snap->version = ++topology_version;
+	old = __atomic_exchange_n(&topology_current, snap, __ATOMIC_SEQ_CST);
+	printf("topology: version %lu, %d hosts, %d entries\n",
+	       snap->version, snap->nr_hosts, snap->set->nr_entries);
+	if (!old)
+		return;
+	topology_synchronize();
+	topology_put(old);
+}
+
+void topology_exit(void)
+{
+	struct topo_snapshot *old;
+
+	old = __atomic_exchange_n(&topology_current, NULL, __ATOMIC_SEQ_CST);
+	if (!old)
+		return;
+	topology_synchronize();
+	topology_put(old);
+}
+
+void topology_show_stats(void)
+{
+	struct topo_snapshot *snap;
+	int idx, i, links = 0;
+
+	snap = topology_pin(&idx);
+	if (snap) {
+		for (i = 0; i < snap->nr_hosts; i++)
+			links += snap->hosts[i]->nr_entries;
+		printf("topology: version %lu, %d hosts, %d entries, "
+		       "%d host entries, %d references\n",
+		       snap->version, snap->nr_hosts, snap->set->nr_entries,
+		       links, __atomic_load_n(&snap->refs, __ATOMIC_RELAXED));
+	}
+	topology_unpin(idx);
+	printf("topology: %lu log page reads, %lu from unknown hosts, "
+	       "%lu snapshots built\n",
+	       __atomic_load_n(&topology_stats.reads, __ATOMIC_RELAXED),
+	       __atomic_load_n(&topology_stats.unknown_reads,
+			       __ATOMIC_RELAXED),
+	       topology_version);
+}
@@ -0,0 +1,70 @@
+#ifndef _NVMET_TOPOLOGY_H
+#define _NVMET_TOPOLOGY_H
+
+/*
+ * Immutable view of the discovery database. Never modified after
+ * it has been published; see topology.c.
+ */
+
+/* Discovery log entry of a subsystem/port link, shared by all hosts */
+struct topo_entry {
+	int subsys_id;
+	int port_id;
+	struct nvmf_disc_rsp_page_entry entry;
+};
+
+/* Entries of a snapshot, kept alive by the host pages pointing into it */
+struct topo_entry_set {
+	int refs;
+	int nr_entries;
+	struct topo_entry *entries;
+};
+
+/* Log page of a host, carried over between snapshots by logcache */
+struct topo_host {
+	int refs;
+	char *nqn;
+	/* Log page header, genctr and numrec filled in */
+	struct nvmf_disc_rsp_page_hdr *hdr;
+	int nr_entries;
+	struct nvmf_disc_rsp_page_entry **entries;
+	/* Entry set @entries points into */
+	struct topo_entry_set *set;
+};
+
+struct topo_snapshot {
+	unsigned long version;
+	int refs;
+	int nr_hosts;
+	struct topo_host **hosts;
+	/* Log page for hosts not in the database */
+	struct topo_host unknown;
+	/* Entries formatted for this snapshot */
+	struct topo_entry_set *set;
+};
+
+struct topo_snapshot *topology_pin(int *idx);
+void topology_unpin(int idx);
+void topology_get(struct topo_snapshot *snap);
+void topology_put(struct topo_snapshot *snap);
+struct topo_host *topology_find_host(struct topo_snapshot *snap,
+				     const char *hostnqn);
+struct topo_host *topology_host_page(struct topo_snapshot *snap,
+				     const char *hostnqn);
+struct topo_entry *topology_find_entry(struct topo_snapshot *snap,
+				       int subsys_id, int port_id);
+
+struct topo_snapshot *topology_alloc(void);
+struct topo_host *topology_alloc_host(struct topo_snapshot *snap,
+				      const char *hostnqn);
+int topology_add_host(struct topo_snapshot *snap, struct topo_host *host);
+void topology_get_host(struct topo_host *host);
+void topology_put_host(struct topo_host *host);
+void topology_sort_hosts(struct topo_snapshot *snap);
+void topology_sort_entries(struct topo_snapshot *snap);
+void topology_free(struct topo_snapshot *snap);
+void topology_publish(struct topo_snapshot *snap);
+void topology_exit(void);
+void topology_show_stats(void);
+
+#endif /* _NVMET_TOPOLOGY_H */
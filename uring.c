@@ -0,0 +1,591 @@
+/*
+ * uring.c
+ * io_uring transport backend for the reactor threads
+ *
+ * Each reactor owns one ring. Endpoint sockets are registered as fixed
+ * files and receive data via multishot recv into a provided buffer ring;
+ * the endpoint send queue is flushed with one sendmsg request at a time,
+ * submitted together with the next wait for completions.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include "common.h"
+#include "reactor.h"
+#include "endpoint.h"
+#include "tcp.h"
+#include "uring.h"
+
+#define URING_ENTRIES		256
+#define URING_MAX_FILES		1024
+#define URING_BUF_GROUP		0
+#define URING_BUF_COUNT		64
+#define URING_BUF_SIZE		16384
+#define URING_RX_MAX		(1024 * 1024)
+#define URING_SEND_IOVS		32
+
+/* Operation type, stored in the low bits of the SQE user_data */
+enum {
+	URING_OP_WAKEUP,
+	URING_OP_RECV,
+	URING_OP_SEND,
+	URING_OP_CANCEL,
+};
+#define URING_OP_MASK		0x7
+
+struct uring {
+	int fd;
+	unsigned int *sq_head;
+	unsigned int *sq_tail;
+	unsigned int *sq_mask;
+	unsigned int *sq_array;
+	unsigned int sq_entries;
+	unsigned int sq_local_tail;
+	unsigned int *cq_head;
+	unsigned int *cq_tail;
+	unsigned int *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	void *sq_ring;
+	size_t sq_ring_sz;
+	void *cq_ring;
+	size_t cq_ring_sz;
+	size_t sqes_sz;
+	struct io_uring_buf_ring *buf_ring;
+	size_t buf_ring_sz;
+	u8 *bufs;
+	unsigned short buf_tail;
+	int free_slots[URING_MAX_FILES];
+	int nr_free_slots;
+};
+
+struct uring_tx {
+	struct endpoint *ep;
+	struct msghdr msg;
+	size_t len;
+	struct iovec iov[URING_SEND_IOVS];
+};
+
+static int uring_setup(unsigned int entries, struct io_uring_params *p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int uring_enter(int fd, unsigned int to_submit,
+		       unsigned int min_complete, unsigned int flags,
+		       void *arg, size_t argsz)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+		       flags, arg, argsz);
+}
+
+static int uring_register(int fd, unsigned int opcode, void *arg,
+			  unsigned int nr_args)
+{
+	return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static unsigned int uring_sq_pending(struct uring *u)
+{
+	return u->sq_local_tail -
+		__atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+}
+
+static struct io_uring_sqe *uring_get_sqe(struct uring *u)
+{
+	struct io_uring_sqe *sqe;
+	unsigned int idx;
+
+	if (uring_sq_pending(u) >= u->sq_entries) {
+		/* SQ ring full, push out what we have so far */
+		if (uring_enter(u->fd, uring_sq_pending(u), 0, 0,
+				NULL, 0) < 0)
+			return NULL;
+		if (uring_sq_pending(u) >= u->sq_entries)
+			return NULL;
+	}
+	idx = u->sq_local_tail & *u->sq_mask;
+	sqe = &u->sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+	u->sq_array[idx] = idx;
+	u->sq_local_tail++;
+	__atomic_store_n(u->sq_tail, u->sq_local_tail, __ATOMIC_RELEASE);
+	return sqe;
+}
+
+static void uring_recycle_buf(struct uring *u, unsigned short bid)
+{
+	struct io_uring_buf *buf;
+
+	buf = &u->buf_ring->bufs[u->buf_tail & (URING_BUF_COUNT - 1)];
+	buf->addr = (u64)(unsigned long)(u->bufs + bid * URING_BUF_SIZE);
+	buf->len = URING_BUF_SIZE;
+	buf->bid = bid;
+	u->buf_tail++;
+	__atomic_store_n(&u->buf_ring->tail, u->buf_tail, __ATOMIC_RELEASE);
+}
+
+static void uring_set_file(struct uring *u, int slot, int fd)
+{
+	struct io_uring_rsrc_update2 up;
+
+	memset(&up, 0, sizeof(up));
+	up.offset = slot;
+	up.data = (u64)(unsigned long)&fd;
+	up.nr = 1;
+	if (uring_register(u->fd, IORING_REGISTER_FILES_UPDATE2,
+			   &up, sizeof(up)) < 0)
+		fprintf(stderr, "uring: failed to update file slot %d, error %d\n",
+			slot, errno);
+}
+
+static void uring_prep_fd(struct io_uring_sqe *sqe, struct endpoint *ep)
+{
+	if (ep->uring_slot >= 0) {
+		sqe->fd = ep->uring_slot;
+		sqe->flags |= IOSQE_FIXED_FILE;
+	} else
+		sqe->fd = ep->sockfd;
+}
+
+static int uring_arm_wakeup(struct reactor *r)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = uring_get_sqe(r->uring);
+	if (!sqe)
+		return -EBUSY;
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = r->eventfd;
+	sqe->poll32_events = POLLIN;
+	sqe->len = IORING_POLL_ADD_MULTI;
+	sqe->user_data = URING_OP_WAKEUP;
+	return 0;
+}
+
+static int uring_arm_recv(struct reactor *r, struct endpoint *ep)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = uring_get_sqe(r->uring);
+	if (!sqe)
+		return -EBUSY;
+	sqe->opcode = IORING_OP_RECV;
+	uring_prep_fd(sqe, ep);
+	sqe->flags |= IOSQE_BUFFER_SELECT;
+	sqe->buf_group = URING_BUF_GROUP;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->user_data = (u64)(unsigned long)ep | URING_OP_RECV;
+	ep->uring_recv_armed = true;
+	return 0;
+}
+
+/*
+ * Submit the send queue of an endpoint. Only one sendmsg request is in
+ * flight at any time so PDUs cannot be reordered when the socket
+ * buffer fills up.
+ * Nothing re-submits the send queue if this fails, so the caller has
+ * to drop the endpoint on error.
+ */
+int uring_flush(struct reactor *r, struct endpoint *ep)
+{
+	struct io_uring_sqe *sqe;
+	struct uring_tx *tx;
+	bool more;
+	int i;
+
+	if (ep->uring_tx_inflight || ep->uring_dying ||
+	    list_empty(&ep->send_list))
+		return 0;
+
+	tx = malloc(sizeof(*tx));
+	if (!tx)
+		return -ENOMEM;
+	sqe = uring_get_sqe(r->uring);
+	if (!sqe) {
+		free(tx);
+		return -EBUSY;
+	}
+	memset(&tx->msg, 0, sizeof(tx->msg));
+	tx->ep = ep;
+	tx->msg.msg_iov = tx->iov;
+	tx->msg.msg_iovlen = tcp_send_iov(ep, tx->iov, URING_SEND_IOVS,
+					  &more);
+	tx->len = 0;
+	for (i = 0; i < tx->msg.msg_iovlen; i++)
+		tx->len += tx->iov[i].iov_len;
+
+	sqe->opcode = IORING_OP_SENDMSG;
+	uring_prep_fd(sqe, ep);
+	sqe->addr = (u64)(unsigned long)&tx->msg;
+	sqe->len = 1;
+	sqe->msg_flags = MSG_WAITALL | MSG_NOSIGNAL | (more ? MSG_MORE : 0);
+	sqe->user_data = (u64)(unsigned long)tx | URING_OP_SEND;
+	ep->uring_tx_inflight++;
+	return 0;
+}
+
+static void uring_release_endpoint(struct reactor *r, struct endpoint *ep)
+{
+	if (ep->uring_recv_armed || ep->uring_tx_inflight)
+		return;
+
+	if (ep->uring_slot >= 0) {
+		uring_set_file(r->uring, ep->uring_slot, -1);
+		r->uring->free_slots[r->uring->nr_free_slots++] =
+			ep->uring_slot;
+		ep->uring_slot = -1;
+	}
+	reactor_release_endpoint(r, ep);
+}
+
+int uring_add_endpoint(struct reactor *r, struct endpoint *ep)
+{
+	struct uring *u = r->uring;
+
+	ep->uring_slot = -1;
+	if (u->nr_free_slots) {
+		ep->uring_slot = u->free_slots[--u->nr_free_slots];
+		uring_set_file(u, ep->uring_slot, ep->sockfd);
+	}
+	return uring_arm_recv(r, ep);
+}
+
+void uring_del_endpoint(struct reactor *r, struct endpoint *ep)
+{
+	struct io_uring_sqe *sqe;
+
+	if (ep->uring_dying)
+		return;
+	ep->uring_dying = true;
+
+	/* Terminates both the multishot recv and any pending sends */
+	shutdown(ep->sockfd, SHUT_RDWR);
+	if (ep->uring_recv_armed) {
+		sqe = uring_get_sqe(r->uring);
+		if (sqe) {
+			sqe->opcode = IORING_OP_ASYNC_CANCEL;
+			sqe->addr = (u64)(unsigned long)ep | URING_OP_RECV;
+			sqe->user_data = URING_OP_CANCEL;
+		}
+	}
+	uring_release_endpoint(r, ep);
+}
+
+/*
+ * Returns -EMSGSIZE if the receive buffer would grow beyond
+ * URING_RX_MAX. The data cannot be dropped without losing track of
+ * the PDU stream, so the connection has to be closed; this is not
+ * to be confused with -ENOBUFS from an empty buffer ring.
+ */
+static int uring_rx_append(struct endpoint *ep, u8 *data, size_t len)
+{
+	/* Move a partial PDU left over to the start of the buffer */
+	if (ep->rx_head) {
+		memmove(ep->rx_buf, ep->rx_buf + ep->rx_head,
+			ep->rx_tail - ep->rx_head);
+		ep->rx_tail -= ep->rx_head;
+		ep->rx_head = 0;
+	}
+	if (ep->rx_tail + len > ep->rx_size) {
+		size_t size = ep->rx_size ? ep->rx_size : URING_BUF_SIZE;
+		u8 *buf;
+
+		while (size < ep->rx_tail + len)
+			size *= 2;
+		if (size > URING_RX_MAX)
+			return -EMSGSIZE;
+		buf = realloc(ep->rx_buf, size);
+		if (!buf)
+			return -ENOMEM;
+		ep->rx_buf = buf;
+		ep->rx_size = size;
+	}
+	memcpy(ep->rx_buf + ep->rx_tail, data, len);
+	ep->rx_tail += len;
+	return 0;
+}
+
+static void uring_complete_recv(struct reactor *r, struct endpoint *ep,
+				struct io_uring_cqe *cqe)
+{
+	struct uring *u = r->uring;
+	int ret = cqe->res;
+
+	if (!(cqe->flags & IORING_CQE_F_MORE))
+		ep->uring_recv_armed = false;
+
+	if (ret > 0) {
+		unsigned short bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+
+		if (!ep->uring_dying)
+			ret = uring_rx_append(ep, u->bufs + bid * URING_BUF_SIZE,
+					      cqe->res);
+		uring_recycle_buf(u, bid);
+	} else if (!ret)
+		ret = -ENODATA;
+
+	if (ep->uring_dying) {
+		uring_release_endpoint(r, ep);
+		return;
+	}
+	if (ret < 0 && ret != -ENOBUFS) {
+		if (ret != -ENODATA)
+			fprintf(stderr, "ep %d: recv error %d\n",
+				ep->sockfd, ret);
+		reactor_del_endpoint(r, ep);
+		return;
+	}
+
+	ep->kato_reset = true;
+	if (endpoint_handle_data(ep) < 0) {
+		reactor_del_endpoint(r, ep);
+		return;
+	}
+	if (!ep->uring_recv_armed && uring_arm_recv(r, ep) < 0) {
+		reactor_del_endpoint(r, ep);
+		return;
+	}
+	if (uring_flush(r, ep) < 0)
+		reactor_del_endpoint(r, ep);
+}
+
+static void uring_complete_send(struct reactor *r, struct uring_tx *tx,
+				struct io_uring_cqe *cqe)
+{
+	struct endpoint *ep = tx->ep;
+
+	ep->uring_tx_inflight--;
+	if (cqe->res != tx->len && !ep->uring_dying) {
+		fprintf(stderr, "ep %d: send error %d (%zu bytes)\n",
+			ep->sockfd, cqe->res, tx->len);
+		free(tx);
+		reactor_del_endpoint(r, ep);
+		return;
+	}
+	free(tx);
+	if (ep->uring_dying) {
+		uring_release_endpoint(r, ep);
+		return;
+	}
+	tcp_send_complete(ep, cqe->res);
+	if (uring_flush(r, ep) < 0)
+		reactor_del_endpoint(r, ep);
+}
+
+static void uring_complete(struct reactor *r, struct io_uring_cqe *cqe)
+{
+	void *ptr = (void *)(unsigned long)(cqe->user_data & ~URING_OP_MASK);
+	u64 val;
+
+	switch (cqe->user_data & URING_OP_MASK) {
+	case URING_OP_WAKEUP:
+		if (read(r->eventfd, &val, sizeof(val)) < 0 &&
+		    errno != EAGAIN)
+			fprintf(stderr, "reactor %d: eventfd error %d\n",
+				r->id, errno);
+		if (!(cqe->flags & IORING_CQE_F_MORE))
+			uring_arm_wakeup(r);
+		reactor_add_pending(r);
+		reactor_process_done(r);
+		break;
+	case URING_OP_RECV:
+		uring_complete_recv(r, ptr, cqe);
+		break;
+	case URING_OP_SEND:
+		uring_complete_send(r, ptr, cqe);
+		break;
+	default:
+		break;
+	}
+}
+
+/*
+ * Submit all queued SQEs, wait up to @timeout_ms for completions
+ * and process them.
+ */
+int uring_run(struct reactor *r, int timeout_ms)
+{
+	struct uring *u = r->uring;
+	struct io_uring_getevents_arg arg;
+	struct __kernel_timespec ts;
+	unsigned int head, tail;
+	int ret;
+
+	memset(&arg, 0, sizeof(arg));
+	ts.tv_sec = timeout_ms / 1000;
+	ts.tv_nsec = (timeout_ms % 1000) * 1000000;
+	arg.ts = (u64)(unsigned long)&ts;
+	ret = uring_enter(u->fd, uring_sq_pending(u), 1,
+			  IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG,
+			  &arg, sizeof(arg));
+	if (ret < 0 && errno != ETIME && errno != EINTR) {
+		fprintf(stderr, "reactor %d: io_uring_enter error %d\n",
+			r->id, errno);
+		return -errno;
+	}
+
+	head = *u->cq_head;
+	while (head != (tail = __atomic_load_n(u->cq_tail,
+					       __ATOMIC_ACQUIRE))) {
+		while (head != tail) {
+			struct io_uring_cqe cqe = u->cqes[head & *u->cq_mask];
+
+			head++;
+			__atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+			uring_complete(r, &cqe);
+		}
+	}
+	return 0;
+}
+
+static void uring_free(struct uring *u)
+{
+	if (u->bufs)
+		free(u->bufs);
+	if (u->buf_ring)
+		munmap(u->buf_ring, u->buf_ring_sz);
+	if (u->sqes)
+		munmap(u->sqes, u->sqes_sz);
+	if (u->cq_ring && u->cq_ring != u->sq_ring)
+		munmap(u->cq_ring, u->cq_ring_sz);
+	if (u->sq_ring)
+		munmap(u->sq_ring, u->sq_ring_sz);
+	if (u->fd >= 0)
+		close(u->fd);
+	free(u);
+}
+
+int uring_init(struct reactor *r)
+{
+	struct io_uring_params p;
+	struct io_uring_rsrc_register rr;
+	struct io_uring_buf_reg reg;
+	struct uring *u;
+	int i, ret;
+
+	u = calloc(1, sizeof(*u));
+	if (!u)
+		return -ENOMEM;
+
+	memset(&p, 0, sizeof(p));
+	u->fd = uring_setup(URING_ENTRIES, &p);
+	if (u->fd < 0) {
+		ret = -errno;
+		free(u);
+		return ret;
+	}
+	if (!(p.features & IORING_FEAT_EXT_ARG)) {
+		ret = -EOPNOTSUPP;
+		goto out_free;
+	}
+
+	u->sq_ring_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	u->cq_ring_sz = p.cq_off.cqes +
+		p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (u->cq_ring_sz > u->sq_ring_sz)
+			u->sq_ring_sz = u->cq_ring_sz;
+		u->cq_ring_sz = u->sq_ring_sz;
+	}
+	u->sq_ring = mmap(NULL, u->sq_ring_sz, PROT_READ | PROT_WRITE,
+			  MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+	if (u->sq_ring == MAP_FAILED) {
+		u->sq_ring = NULL;
+		ret = -errno;
+		goto out_free;
+	}
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		u->cq_ring = u->sq_ring;
+	else {
+		u->cq_ring = mmap(NULL, u->cq_ring_sz, PROT_READ | PROT_WRITE,
+				  MAP_SHARED | MAP_POPULATE, u->fd,
+				  IORING_OFF_CQ_RING);
+		if (u->cq_ring == MAP_FAILED) {
+			u->cq_ring = NULL;
+			ret = -errno;
+			goto out_free;
+		}
+	}
+	u->sqes_sz = p.sq_entries * sizeof(struct io_uring_sqe);
+	u->sqes = mmap(NULL, u->sqes_sz, PROT_READ | PROT_WRITE,
+		       MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+	if (u->sqes == MAP_FAILED) {
+		u->sqes = NULL;
+		ret = -errno;
+		goto out_free;
+	}
+	u->sq_head = u->sq_ring + p.sq_off.head;
+	u->sq_tail = u->sq_ring + p.sq_off.tail;
+	u->sq_mask = u->sq_ring + p.sq_off.ring_mask;
+	u->sq_array = u->sq_ring + p.sq_off.array;
+	u->sq_entries = p.sq_entries;
+	u->sq_local_tail = *u->sq_tail;
+	u->cq_head = u->cq_ring + p.cq_off.head;
+	u->cq_tail = u->cq_ring + p.cq_off.tail;
+	u->cq_mask = u->cq_ring + p.cq_off.ring_mask;
+	u->cqes = u->cq_ring + p.cq_off.cqes;
+
+	/* Sparse fixed file table for the endpoint sockets */
+	memset(&rr, 0, sizeof(rr));
+	rr.nr = URING_MAX_FILES;
+	rr.flags = IORING_RSRC_REGISTER_SPARSE;
+	if (uring_register(u->fd, IORING_REGISTER_FILES2,
+			   &rr, sizeof(rr)) < 0) {
+		ret = -errno;
+		goto out_free;
+	}
+	for (i = 0; i < URING_MAX_FILES; i++)
+		u->free_slots[i] = URING_MAX_FILES - i - 1;
+	u->nr_free_slots = URING_MAX_FILES;
+
+	/* Provided buffer ring for multishot recv */
+	u->buf_ring_sz = URING_BUF_COUNT * sizeof(struct io_uring_buf);
+	u->buf_ring = mmap(NULL, u->buf_ring_sz, PROT_READ | PROT_WRITE,
+			   MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+	if (u->buf_ring == MAP_FAILED) {
+		u->buf_ring = NULL;
+		ret = -errno;
+		goto out_free;
+	}
+	u->bufs = malloc(URING_BUF_COUNT * URING_BUF_SIZE);
+	if (!u->bufs) {
+		ret = -ENOMEM;
+		goto out_free;
+	}
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (u64)(unsigned long)u->buf_ring;
+	reg.ring_entries = URING_BUF_COUNT;
+	reg.bgid = URING_BUF_GROUP;
+	if (uring_register(u->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+		ret = -errno;
+		goto out_free;
+	}
+	for (i = 0; i < URING_BUF_COUNT; i++)
+		uring_recycle_buf(u, i);
+
+	r->uring = u;
+	ret = uring_arm_wakeup(r);
+	if (ret < 0) {
+		r->uring = NULL;
+		goto out_free;
+	}
+	return 0;
+
+out_free:
+	uring_free(u);
+	return ret;
+}
+
+void uring_exit(struct reactor *r)
+{
+	if (!r->uring)
+		return;
+	uring_free(r->uring);
+	r->uring = NULL;
+}
@@ -0,0 +1,11 @@
+#ifndef _NVMET_URING_H
+#define _NVMET_URING_H
+
+int uring_init(struct reactor *r);
+void uring_exit(struct reactor *r);
+int uring_run(struct reactor *r, int timeout_ms);
+int uring_add_endpoint(struct reactor *r, struct endpoint *ep);
+void uring_del_endpoint(struct reactor *r, struct endpoint *ep);
+int uring_flush(struct reactor *r, struct endpoint *ep);
+
+#endif /* _NVMET_URING_H */
@@ -0,0 +1,122 @@
+/*
+ * worker.c
+ * Thread pool for admin commands which are too slow to be executed
+ * on the reactor, like building a log page from the database.
+ *
+ * Workers only fill in the command data and status; the command is
+ * handed back to the reactor owning the endpoint for completion, so
+ * endpoints and their sockets are still only ever touched by a single
+ * thread.
+ */
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <signal.h>
+
+#include "common.h"
+#include "affinity.h"
+#include "reactor.h"
+#include "worker.h"
+
+static pthread_t *workers;
+static int nr_workers;
+static LIST_HEAD(work_list);
+static pthread_mutex_t work_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t work_cond = PTHREAD_COND_INITIALIZER;
+static bool work_stopping;
+
+static void *worker_thread(void *arg)
+{
+	struct ep_qe *qe;
+	sigset_t set;
+
+	sigemptyset(&set);
+	sigaddset(&set, SIGPIPE);
+	pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+	pthread_mutex_lock(&work_lock);
+	while (!work_stopping) {
+		if (list_empty(&work_list)) {
+			pthread_cond_wait(&work_cond, &work_lock);
+			continue;
+		}
+		qe = list_first_entry(&work_list, struct ep_qe, work_node);
+		list_del_init(&qe->work_node);
+		pthread_mutex_unlock(&work_lock);
+
+		qe->work_status = qe->work(qe->ep, qe);
+		reactor_complete_work(qe);
+
+		pthread_mutex_lock(&work_lock);
+	}
+	pthread_mutex_unlock(&work_lock);
+
+	pthread_exit(NULL);
+	return NULL;
+}
+
+/*
+ * Execute @work for @qe on a worker thread. The endpoint is pinned
+ * until the reactor has picked up the completion.
+ * Returns -EAGAIN if no workers are running; the caller is expected
+ * to execute the command inline then.
+ */
+int worker_queue(struct ep_qe *qe,
+		 int (*work)(struct endpoint *ep, struct ep_qe *qe))
+{
+	if (!nr_workers || !qe->ep->reactor)
+		return -EAGAIN;
+
+	qe->work = work;
+	qe->ep->nr_work++;
+	pthread_mutex_lock(&work_lock);
+	list_add_tail(&qe->work_node, &work_list);
+	pthread_cond_signal(&work_cond);
+	pthread_mutex_unlock(&work_lock);
+	return 0;
+}
+
+int worker_init(struct etcd_cdc_ctx *ctx)
+{
+	int i, ret, num = ctx->nr_workers;
+
+	if (num < 1)
+		return 0;
+
+	workers = calloc(num, sizeof(pthread_t));
+	if (!workers)
+		return -ENOMEM;
+
+	for (i = 0; i < num; i++) {
+		ret = pthread_create(&workers[i], NULL, worker_thread, NULL);
+		if (ret) {
+			fprintf(stderr, "worker %d: failed to start, error %d\n",
+				i, ret);
+			worker_exit();
+			return -ret;
+		}
+		affinity_pin(workers[i], ctx->cpus, ctx->nr_cpus);
+		nr_workers++;
+	}
+	printf("started %d workers\n", nr_workers);
+	return 0;
+}
+
+/*
+ * Must be called after the reactors are stopped, as those wait for
+ * the outstanding work of their endpoints.
+ */
+void worker_exit(void)
+{
+	int i, num = nr_workers;
+
+	nr_workers = 0;
+	pthread_mutex_lock(&work_lock);
+	work_stopping = true;
+	pthread_cond_broadcast(&work_cond);
+	pthread_mutex_unlock(&work_lock);
+	for (i = 0; i < num; i++)
+		pthread_join(workers[i], NULL);
+	free(workers);
+	workers = NULL;
+}
@@ -0,0 +1,9 @@
+#ifndef _NVMET_WORKER_H
+#define _NVMET_WORKER_H
+
+int worker_init(struct etcd_cdc_ctx *ctx);
+void worker_exit(void);
+int worker_queue(struct ep_qe *qe,
+		 int (*work)(struct endpoint *ep, struct ep_qe *qe));
+
+#endif /* _NVMET_WORKER_H */